@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <argp.h>
 #include <signal.h>
@@ -85,8 +86,52 @@ static t_opcode instr_table[] = {
 		{ "add", add },
 		{ "sub", sub },
 		{ "mov", mov },
+		{ "movi", movi },
 		{ "dimd", dimd },
-		{ "jmp", jmp }
+		{ "jmp", jmp },
+		{ "bank", bank },
+		{ "bmove", bmove },
+		{ "bfill", bfill },
+		{ "bcomp", bcomp },
+		{ "ei", ei },
+		{ "di", di },
+		{ "reti", reti },
+		{ "wfi", wfi },
+		{ "call", call },
+		{ "rts", rts },
+		{ "push", push },
+		{ "pop", pop },
+		{ "mul", mul },
+		{ "divu", divu },
+		{ "modu", modu },
+		{ "and", and },
+		{ "or", or },
+		{ "xor", xor },
+		{ "not", not },
+		{ "shl", shl },
+		{ "shr", shr },
+		{ "sar", sar },
+		{ "ldb", ldb },
+		{ "ldw", ldw },
+		{ "stb", stb },
+		{ "stw", stw },
+		{ "vaddb", vadd },
+		{ "vaddw", vadd },
+		{ "vsubb", vsub },
+		{ "vsubw", vsub },
+		{ "vminb", vmin },
+		{ "vminw", vmin },
+		{ "vmaxb", vmax },
+		{ "vmaxw", vmax },
+		{ "vcmpb", vcmp },
+		{ "vcmpw", vcmp },
+		{ "vsumb", vsum },
+		{ "vsumw", vsum },
+		{ "hcall", hcall },
+		{ "cpuid", cpuid },
+		{ "cstart", cstart },
+		{ "cas", cas },
+		{ "xadd", xadd }
 };
 
 
@@ -198,7 +243,8 @@ static __inline__ uint32_t decode_complex(const char *instr, uint32_t mnemonic,
 		case '@':
 			mem_dst = atoi(&arg1[1]);
 			DBG(printf("memdst: %d\n", mem_dst));
-			if ((mem_dst < MEM_START_RW) || (mem_dst > RAM_SIZE)) {
+			/* 16 bit offset into the bank, the cpu checks the read only area */
+			if ((mem_dst < 0) || (mem_dst > 0xffff)) {
 				printf("%s:%d:%d: address %s out of bounds.\n", FILE_NAME, line, *col, arg1);
 				return OPCODE_ENCODE_ERROR;
 			}
@@ -237,7 +283,7 @@ static __inline__ uint32_t decode_complex(const char *instr, uint32_t mnemonic,
 		case '@':
 			mem_src = atoi(&arg2[1]);
 			DBG(printf("memsrc: %d\n", mem_src));
-			if ((mem_src < 0) || (mem_src > RAM_SIZE)) {
+			if ((mem_src < 0) || (mem_src > 0xffff)) {
 				printf("%s:%d:%d: error: address %s out of bounds.\n", FILE_NAME, line, *col, arg2);
 				return OPCODE_ENCODE_ERROR;
 			}
@@ -303,11 +349,13 @@ static __inline__ uint32_t decode_dimd(uint32_t mnemonic, char *c, int line, int
 	return mode;
 }
 
+/* jmp and call: a label, or a register holding the address */
 static __inline__ uint32_t decode_jmp(uint32_t mnemonic, char *c, int line, int *col)
 {
 	char arg1[16];
 	uint16_t i;
 	uint32_t pc = 0;
+	int reg;
 
 	DBG(printf("jmp\n"));
 
@@ -323,13 +371,269 @@ static __inline__ uint32_t decode_jmp(uint32_t mnemonic, char *c, int line, int
 		}
 	}
 
+	if ((pc == 0) && (arg1[0] == 'r') && isdigit((unsigned char)arg1[1])) {
+		reg = atoi(&arg1[1]);
+		if (reg > GP_REG_MAX) {
+			printf("%s:%d:%d: error: register %s out of bounds.\n", FILE_NAME, line, *col, arg1);
+			return OPCODE_ENCODE_ERROR;
+		}
+		return ((mnemonic << 0) | (reg << 8));
+	}
+
 	if (pc == 0) {
 		printf("%s:%d: error: undeclared label %s\n", FILE_NAME, line, arg1);
 		return OPCODE_ENCODE_ERROR;
 	}
 
-	return ((jmp << 0) | (pc << 8));
+	return ((mnemonic << 0) | (pc << 8));
+
+}
+
+/* not: a register or a memory word */
+static __inline__ uint32_t decode_unary(const char *name, uint32_t mnemonic, char *c, int line, int *col)
+{
+	char arg1[16];
+	int val;
+
+	DBG(printf("%s'\n", name));
+
+	skip_spaces(&c, line, col);
+	get_argument(&c, arg1, line, col);
+	skip_spaces(&c, line, col);
+
+	DBG(printf("arg1: %s \n", arg1));
+
+	switch (arg1[0]) {
+		case 'R':
+		case 'r':
+			val = atoi(&arg1[1]);
+			if (val < 0 || val > GP_REG_MAX) {
+				printf("%s:%d:%d: error: register %s out of bounds.\n", FILE_NAME, line, *col, arg1);
+				return OPCODE_ENCODE_ERROR;
+			}
+			return (mnemonic << 0) | OP_DST_REG | (val << 8);
+		case '@':
+			val = atoi(&arg1[1]);
+			if ((val < 0) || (val > 0xffff)) {
+				printf("%s:%d:%d: address %s out of bounds.\n", FILE_NAME, line, *col, arg1);
+				return OPCODE_ENCODE_ERROR;
+			}
+			return (mnemonic << 0) | OP_DST_MEM | (val << 16);
+		default:
+			printf("%s:%d:%d: error: %s expects a register or memory, not %s.\n", FILE_NAME, line, *col, name, arg1);
+			return OPCODE_ENCODE_ERROR;
+	}
+}
+
+/* push, pop and cpuid: one register */
+static __inline__ uint32_t decode_stack(const char *name, uint32_t mnemonic, char *c, int line, int *col)
+{
+	char arg1[16];
+	int reg;
+
+	DBG(printf("%s'\n", name));
+
+	skip_spaces(&c, line, col);
+	get_argument(&c, arg1, line, col);
+	skip_spaces(&c, line, col);
+
+	DBG(printf("arg1: %s \n", arg1));
+
+	reg = atoi(&arg1[1]);
+	if (((arg1[0] != 'r') && (arg1[0] != 'R')) || (reg < 0) || (reg > GP_REG_MAX)) {
+		printf("%s:%d:%d: error: %s expects a register, not %s.\n", FILE_NAME, line, *col, name, arg1);
+		return OPCODE_ENCODE_ERROR;
+	}
+
+	return (mnemonic << 0) | (reg << 8);
+}
+
+/* ldb, ldw, stb and stw: a register, a base register with optional '+' and an offset */
+static __inline__ uint32_t decode_ldst(const char *name, uint32_t mnemonic, char *c, int line, int *col)
+{
+	char arg[16];
+	int size = ((mnemonic == ldb) || (mnemonic == stb)) ? 1 : 2;
+	int val, neg = 0;
+
+	DBG(printf("%s'\n", name));
+
+	for (int i = 0; i < 2; i++) {
+		skip_spaces(&c, line, col);
+		get_argument(&c, arg, line, col);
 
+		DBG(printf("arg%d: %s \n", i + 1, arg));
+
+		val = atoi(&arg[1]);
+		if (((arg[0] != 'r') && (arg[0] != 'R')) || (val < 0) || (val > GP_REG_MAX)) {
+			printf("%s:%d:%d: error: %s expects a register, not %s.\n", FILE_NAME, line, *col, name, arg);
+			return OPCODE_ENCODE_ERROR;
+		}
+		mnemonic |= (val << (8 + 4 * i));
+
+		if ((i == 1) && (*c == '+')) {
+			mnemonic |= OP_LDST_POST;
+			(void)*c++;
+		}
+		skip_spaces(&c, line, col);
+
+		if (i == 1)
+			break;
+
+		if (*c != ',') {
+			printf("%s:%d:%d: syntax error: exptected ',' - Don't know what to do with '%c'\n", FILE_NAME, line, *col, *c);
+			return OPCODE_ENCODE_ERROR;
+		}
+		(void)*c++;
+	}
+
+	/* a post increment steps one element by default */
+	val = (mnemonic & OP_LDST_POST) ? size : 0;
+
+	if (*c == ',') {
+		(void)*c++;
+		skip_spaces(&c, line, col);
+		if (*c == '-') {
+			neg = 1;
+			(void)*c++;
+		}
+		get_argument(&c, arg, line, col);
+
+		val = strtol(arg, NULL, 0);
+		if (neg)
+			val = -val;
+	}
+
+	if ((val < -2048) || (val > 2047)) {
+		printf("%s:%d:%d: error: offset %d out of bounds for %s.\n", FILE_NAME, line, *col, val, name);
+		return OPCODE_ENCODE_ERROR;
+	}
+
+	return mnemonic | ((val & 0xfff) << 20);
+}
+
+/* hcall: a service number */
+static __inline__ uint32_t decode_hcall(uint32_t mnemonic, char *c, int line, int *col)
+{
+	char arg1[16];
+	int val;
+
+	DBG(printf("hcall'\n"));
+
+	skip_spaces(&c, line, col);
+	get_argument(&c, arg1, line, col);
+	skip_spaces(&c, line, col);
+
+	DBG(printf("arg1: %s \n", arg1));
+
+	val = strtol(arg1, NULL, 0);
+	if (!arg1[0] || (val < 0) || (val > 0xff)) {
+		printf("%s:%d:%d: error: service %s out of bounds.\n", FILE_NAME, line, *col, arg1);
+		return OPCODE_ENCODE_ERROR;
+	}
+
+	return (mnemonic << 0) | (val << 8);
+}
+
+static __inline__ uint32_t decode_bank(uint32_t mnemonic, char *c, int line, int *col)
+{
+	char arg1[16];
+	int val;
+
+	DBG(printf("bank'\n"));
+
+	skip_spaces(&c, line, col);
+	get_argument(&c, arg1, line, col);
+	skip_spaces(&c, line, col);
+
+	DBG(printf("arg1: %s \n", arg1));
+
+	if ((arg1[0] == 'r') || (arg1[0] == 'R')) {
+		val = atoi(&arg1[1]);
+		if (val < 0 || val > GP_REG_MAX) {
+			printf("%s:%d:%d: error: register %s out of bounds.\n", FILE_NAME, line, *col, arg1);
+			return OPCODE_ENCODE_ERROR;
+		}
+		return (bank << 0) | OP_SRC_REG | (val << 16);
+	}
+
+	val = strtol(arg1, NULL, 0);
+	if ((val < 0) || (val >= MEM_BANKS)) {
+		printf("%s:%d:%d: error: bank %s out of bounds.\n", FILE_NAME, line, *col, arg1);
+		return OPCODE_ENCODE_ERROR;
+	}
+
+	return (bank << 0) | (val << 16);
+}
+
+/* count registers separated by ',', the first at bit 8 and each next one 4 bits up */
+static __inline__ uint32_t decode_regs(const char *name, uint32_t mnemonic, int count, char **c, int line, int *col)
+{
+	char arg[16];
+	int val;
+
+	for (int i = 0; i < count; i++) {
+		skip_spaces(c, line, col);
+		get_argument(c, arg, line, col);
+		skip_spaces(c, line, col);
+
+		DBG(printf("arg%d: %s \n", i + 1, arg));
+
+		val = atoi(&arg[1]);
+		if (((arg[0] != 'r') && (arg[0] != 'R')) || (val < 0) || (val > GP_REG_MAX)) {
+			printf("%s:%d:%d: error: %s expects a register, not %s.\n", FILE_NAME, line, *col, name, arg);
+			return OPCODE_ENCODE_ERROR;
+		}
+		mnemonic |= (val << (8 + 4 * i));
+
+		if (i == count - 1)
+			break;
+
+		if (**c != ',') {
+			printf("%s:%d:%d: syntax error: exptected ',' - Don't know what to do with '%c'\n", FILE_NAME, line, *col, **c);
+			return OPCODE_ENCODE_ERROR;
+		}
+		(*c)++;
+	}
+
+	return mnemonic;
+}
+
+/* cstart, cas and xadd: registers only */
+static __inline__ uint32_t decode_smp(const char *name, uint32_t mnemonic, int count, char *c, int line, int *col)
+{
+	DBG(printf("%s'\n", name));
+
+	return decode_regs(name, mnemonic, count, &c, line, col);
+}
+
+/* bmove, bfill, bcomp and the vector instructions: three registers and for bmove/bcomp an optional source bank */
+static __inline__ uint32_t decode_block(const char *name, uint32_t mnemonic, char *c, int line, int *col)
+{
+	char arg[16];
+	int val;
+
+	DBG(printf("%s'\n", name));
+
+	mnemonic = decode_regs(name, mnemonic, 3, &c, line, col);
+	if (mnemonic == OPCODE_ENCODE_ERROR)
+		return mnemonic;
+
+	if (*c != ',')
+		return mnemonic;
+
+	(void)*c++;
+
+	skip_spaces(&c, line, col);
+	get_argument(&c, arg, line, col);
+
+	val = strtol(arg, NULL, 0);
+	if ((((mnemonic & 0xff) != bmove) && ((mnemonic & 0xff) != bcomp)) ||
+	    (val < 0) || (val >= MEM_BANKS)) {
+		printf("%s:%d:%d: error: source bank %s not valid for %s.\n", FILE_NAME, line, *col, arg, name);
+		return OPCODE_ENCODE_ERROR;
+	}
+
+	return mnemonic | ((val + 1) << 20);
 }
 
 uint32_t encode_instr(char *code_line, int line_nbr)
@@ -389,16 +693,77 @@ uint32_t encode_instr(char *code_line, int line_nbr)
 				DBG(printf("nop'.\n"));
 				mnemonic = nop;
 			break;
+		case ei:
+		case di:
+		case reti:
+		case wfi:
+		case rts:
+				DBG(printf("%s'.\n", instr));
+				mnemonic = code.instr;
+			break;
 		case mov: mnemonic = decode_complex("mov", code.instr, c, line_nbr, &pos);
 			break;
+		case movi: mnemonic = decode_complex("movi", code.instr, c, line_nbr, &pos);
+			break;
 		case add: mnemonic = decode_complex("add", code.instr, c, line_nbr, &pos);
 			break;
 		case sub: mnemonic = decode_complex("sub", code.instr, c, line_nbr, &pos);
 			break;
+		case mul:
+		case divu:
+		case modu:
+		case and:
+		case or:
+		case xor:
+		case shl:
+		case shr:
+		case sar: mnemonic = decode_complex(instr, code.instr, c, line_nbr, &pos);
+			break;
+		case not: mnemonic = decode_unary("not", code.instr, c, line_nbr, &pos);
+			break;
 		case dimd: mnemonic = decode_dimd(code.instr, c, line_nbr, &pos);
 			break;
 		case jmp: mnemonic = decode_jmp(code.instr, c, line_nbr, &pos);
 			break;
+		case call: mnemonic = decode_jmp(code.instr, c, line_nbr, &pos);
+			break;
+		case push: mnemonic = decode_stack("push", code.instr, c, line_nbr, &pos);
+			break;
+		case pop: mnemonic = decode_stack("pop", code.instr, c, line_nbr, &pos);
+			break;
+		case ldb:
+		case ldw:
+		case stb:
+		case stw: mnemonic = decode_ldst(instr, code.instr, c, line_nbr, &pos);
+			break;
+		case vadd:
+		case vsub:
+		case vmin:
+		case vmax:
+		case vcmp:
+		case vsum: mnemonic = decode_block(instr, code.instr, c, line_nbr, &pos);
+			/* the b or w ending picks the lane size */
+			if ((mnemonic != OPCODE_ENCODE_ERROR) && (instr[strlen(instr) - 1] == 'w'))
+				mnemonic |= OP_VEC_WORD;
+			break;
+		case hcall: mnemonic = decode_hcall(code.instr, c, line_nbr, &pos);
+			break;
+		case cpuid: mnemonic = decode_stack("cpuid", code.instr, c, line_nbr, &pos);
+			break;
+		case cstart: mnemonic = decode_smp("cstart", code.instr, 2, c, line_nbr, &pos);
+			break;
+		case cas: mnemonic = decode_smp("cas", code.instr, 3, c, line_nbr, &pos);
+			break;
+		case xadd: mnemonic = decode_smp("xadd", code.instr, 2, c, line_nbr, &pos);
+			break;
+		case bank: mnemonic = decode_bank(code.instr, c, line_nbr, &pos);
+			break;
+		case bmove: mnemonic = decode_block("bmove", code.instr, c, line_nbr, &pos);
+			break;
+		case bfill: mnemonic = decode_block("bfill", code.instr, c, line_nbr, &pos);
+			break;
+		case bcomp: mnemonic = decode_block("bcomp", code.instr, c, line_nbr, &pos);
+			break;
 		default:
 			printf("%s:%d: error: unknown instruction %s\n",FILE_NAME, line_nbr, instr);
 			mnemonic = OPCODE_ENCODE_ERROR;
@@ -423,7 +788,8 @@ int main(int argc,char *argv[])
 
 	e = line_nbr = 0;
 
-	program_addr = MEM_START_PRG + (sizeof(uint32_t) * 4);
+	/* the loader puts the code segment at MEM_START_PRG, without the header */
+	program_addr = MEM_START_PRG;
 
 	while (fgets(line, sizeof(line), prg) && !abort) {
 		printf("%s", line);
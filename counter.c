@@ -0,0 +1,133 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Performance counters.
+ *
+ * A guest that wants to time itself reads retired instructions, cycles,
+ * host time and vdc stalls from MEM_START_COUNTER. Nothing is updated
+ * while the program runs, the read handler puts the current values in
+ * RAM just before the load.
+ *
+ * Instructions and cycles follow from the program and its inputs. Host
+ * time and stalls do not, so every read of them is logged while
+ * recording and a replay, or a rewound machine, reads the logged values
+ * back. A guest that adapts to the host then still replays exactly.
+ *
+ * Stalls must reach the guest only through these reads. A stall also
+ * runs the instruction again and moves icount, so a machine with a log
+ * runs the vdc on the cpu, where nothing stalls.
+ */
+
+#include <time.h>
+
+#include "counter.h"
+#include "machine.h"
+#include "mmio.h"
+#include "ram.h"
+#include "replay.h"
+
+static uint64_t counter_host_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void counter_put(uint16_t *reg, uint64_t val)
+{
+	for (int w = 0; w < 4; w++)
+		reg[w] = (val >> (16 * w)) & 0xffff;
+}
+
+static void counter_read(struct _machine *machine, uint32_t addr,
+	uint32_t len, void *opaque)
+{
+	struct _counter_host *host = &machine->counters;
+	uint64_t icount = machine->cpu_regs.icount;
+	uint8_t data[2 * sizeof(uint64_t)];
+	uint64_t next;
+
+	/* nothing logged for this instruction, take the live values */
+	if (host->logged_icount != icount) {
+		host->logged_icount = icount;
+		host->logged_ns = counter_host_ns() - host->start_ns;
+		host->logged_stalls = host->stalls;
+
+		/* only while recording live, a replay just goes on without */
+		if (machine->replay && !replay_next(machine, &next)) {
+			memcpy(data, &host->logged_ns, sizeof(uint64_t));
+			memcpy(data + sizeof(uint64_t), &host->logged_stalls, sizeof(uint64_t));
+			replay_log(machine, REPLAY_COUNTERS, data, sizeof(data));
+		}
+	}
+
+	counter_put(machine->counter->retired, machine->cpu_regs.retired);
+	counter_put(machine->counter->cycles, icount);
+	counter_put(machine->counter->host_ns, host->logged_ns);
+	counter_put(machine->counter->stalls, host->logged_stalls);
+
+	ram_mark_dirty(machine, MEM_START_COUNTER, sizeof(struct _counter_regs));
+}
+
+static const struct _mmio_region counter_region = {
+	"counter", MEM_START_COUNTER, sizeof(struct _counter_regs),
+	counter_read, NULL, NULL,
+};
+
+static void counter_host_reset(struct _machine *machine)
+{
+	memset(&machine->counters, 0x00, sizeof(struct _counter_host));
+	machine->counters.start_ns = counter_host_ns();
+	machine->counters.logged_icount = UINT64_MAX;
+}
+
+/* also for machines resumed from an image, which are not reset */
+void counter_init(struct _machine *machine)
+{
+	mmio_register(machine, &counter_region);
+
+	counter_host_reset(machine);
+}
+
+void counter_reset(struct _machine *machine)
+{
+	machine->counter = (struct _counter_regs *)(machine->RAM + MEM_START_COUNTER);
+	memset(machine->counter, 0x00, sizeof(struct _counter_regs));
+
+	counter_host_reset(machine);
+}
+
+/* a logged read, the next read in this instruction gets these values */
+void counter_logged(struct _machine *machine, const uint8_t *data, uint32_t len)
+{
+	struct _counter_host *host = &machine->counters;
+
+	if (len < 2 * sizeof(uint64_t))
+		return;
+
+	host->logged_icount = machine->cpu_regs.icount;
+	memcpy(&host->logged_ns, data, sizeof(uint64_t));
+	memcpy(&host->logged_stalls, data + sizeof(uint64_t), sizeof(uint64_t));
+}
@@ -0,0 +1,60 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __COUNTER_H_
+#define __COUNTER_H_
+
+#include <stdint.h>
+
+/*
+ * Read only registers at MEM_START_COUNTER, 64 bit values as 16 bit
+ * words, low word first. They are filled in when the guest reads them.
+ * They count core 0 only, another core reads what core 0 last read.
+ */
+struct _counter_regs {
+	uint16_t retired[4];	/* instructions retired */
+	uint16_t cycles[4];	/* guest cycles, waits included */
+	uint16_t host_ns[4];	/* host time since reset */
+	uint16_t stalls[4];	/* instructions held up by the vdc */
+};
+
+/*
+ * Host side. Host time and stalls differ from run to run, the values a
+ * recorded guest read are logged and given back to a replay.
+ */
+struct _counter_host {
+	uint64_t start_ns;
+	uint64_t stalls;
+	uint64_t logged_icount;		/* instruction the logged values are for */
+	uint64_t logged_ns;
+	uint64_t logged_stalls;
+};
+
+struct _machine;
+
+void counter_init(struct _machine *machine);
+
+void counter_reset(struct _machine *machine);
+
+void counter_logged(struct _machine *machine, const uint8_t *data, uint32_t len);
+
+#endif /* __COUNTER_H_ */
@@ -21,6 +21,8 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <setjmp.h>
+#include <signal.h>
 
 #include "exception.h"
 #include "opcodes.h"
@@ -28,15 +30,27 @@
 #include "vdc.h"
 #include "utils.h"
 #include "machine.h"
+#include "replay.h"
+#include "snapshot.h"
+#include "ram.h"
+#include "rewind.h"
+#include "mmio.h"
+#include "vector.h"
+#include "hcall.h"
+#include "smp.h"
 
-static struct _dbg dbg_info[DBG_HISTORY];
-static int dbg_index = 0;
+#define CPU_WAIT_MS	100	/* how often a sleeping cpu looks for a shutdown */
+#define CPU_SPIN_MAX	16	/* longest polling loop looked for, in instructions */
+
+/* the machine running on this thread, for cpu_fault_handler() */
+static __thread struct _machine *cpu_current;
+static __thread sigjmp_buf cpu_fault;
 
 __inline__ static  void compare(struct _cpu_regs *cpu_regs, uint16_t c1, uint16_t c2)
 {
 	int comp = c2 - c1;
 
-	debug_args(dbg_info, dbg_index, (uint16_t*)&c1, (uint16_t*)&c1);
+	debug_args(cpu_regs->dbg_info, cpu_regs->dbg_index, (uint16_t*)&c1, (uint16_t*)&c1);
 
 	cpu_regs->cr =
 		(comp == 0) ? (COND_EQ | COND_ZERO) :
@@ -44,26 +58,29 @@ __inline__ static  void compare(struct _cpu_regs *cpu_regs, uint16_t c1, uint16_
 		(comp < 0) ? (COND_LE | COND_NEQ) :
 		COND_UNDEF;
 
-	debug_result(dbg_info, dbg_index, (unsigned long)cpu_regs->cr);
+	debug_result(cpu_regs->dbg_info, cpu_regs->dbg_index, (unsigned long)cpu_regs->cr);
 }
 
 __inline__ static void branch(struct _cpu_regs *cpu_regs, enum conditions cond, uint16_t addr)
 {
-	debug_args(dbg_info, dbg_index, (uint16_t *)&cpu_regs->cr, (uint16_t *)&cond);
+	debug_args(cpu_regs->dbg_info, cpu_regs->dbg_index, (uint16_t *)&cpu_regs->cr, (uint16_t *)&cond);
 
 
 	if (cpu_regs->cr & cond) {
 		cpu_regs->pc = addr - sizeof(uint32_t);
 	}
-	debug_result(dbg_info, dbg_index, cpu_regs->pc);
+	debug_result(cpu_regs->dbg_info, cpu_regs->dbg_index, cpu_regs->pc);
 	cpu_regs->cr = COND_UNDEF;
 }
 
 
-static uint16_t cpu_decode_mnemonic(struct _cpu_regs *cpu_regs, uint8_t *RAM, uint32_t *instr, uint16_t **dst, int opsize)
+static uint16_t cpu_decode_mnemonic(struct _machine *machine, uint32_t *instr, uint16_t **dst, int opsize)
 {
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+	uint8_t *RAM = machine->RAM;
 	uint16_t local_src;
 	uint16_t local_dst;
+	uint32_t addr;
 	uint16_t src;
 
 	/* value destination general purpose register */
@@ -83,16 +100,16 @@ static uint16_t cpu_decode_mnemonic(struct _cpu_regs *cpu_regs, uint8_t *RAM, ui
 			goto mnemonic_out;
 		}
 		if (*instr & OP_SRC_MEM) {
-			/* copy from memory */
-			if (local_src > RAM_SIZE) {
-				cpu_regs->exception = EXC_MEM;
-				goto mnemonic_out;
-			}
+			/* copy from memory, past RAM_SIZE is caught by the guard */
+			addr = MEM_BANK(cpu_regs->br, local_src);
+
+			mmio_read(machine, addr, (opsize == SIZE_INT) ? 2 : 1);
+
 			if (opsize == SIZE_INT) {
-				src = RAM[local_src];
-				src |= RAM[local_src + 1] << 8;
+				src = RAM[addr];
+				src |= RAM[addr + 1] << 8;
 			} else
-				src = RAM[local_src];
+				src = RAM[addr];
 
 			goto mnemonic_out;
 		}
@@ -106,11 +123,14 @@ static uint16_t cpu_decode_mnemonic(struct _cpu_regs *cpu_regs, uint8_t *RAM, ui
 		local_src = (*instr >> 8) & 0x0f;
 		local_dst = (*instr >> 16) & 0xffff;
 
-		if ((local_dst > RAM_SIZE) || (local_dst < MEM_START_RW)) {
+		addr = MEM_BANK(cpu_regs->br, local_dst);
+
+		/* the low region shares its page with the I/O registers */
+		if (addr < MEM_START_RW) {
 			cpu_regs->exception = EXC_MEM;
 			goto mnemonic_out;
 		}
-		*(dst) = (uint16_t *)((uint8_t *)RAM + local_dst);
+		*(dst) = (uint16_t *)((uint8_t *)RAM + addr);
 		if (opsize == SIZE_INT)
 			src = cpu_regs->GP_REG[local_src] & 0xffff;
 		else
@@ -118,11 +138,358 @@ static uint16_t cpu_decode_mnemonic(struct _cpu_regs *cpu_regs, uint8_t *RAM, ui
 	}
 
 mnemonic_out:
-		debug_args(dbg_info, dbg_index, &local_dst, &src);
+		debug_args(cpu_regs->dbg_info, cpu_regs->dbg_index, &local_dst, &src);
 
 		return src;
 }
 
+#define CPU_BLOCK_CHUNK	4096	/* bytes a block instruction moves per step */
+
+/*
+ * bmove, bfill and bcomp. The whole block is checked once and then done
+ * with the host functions, at most CPU_BLOCK_CHUNK bytes per step. For a
+ * longer block the registers are moved on to the rest and the
+ * instruction runs again, so exceptions, snapshots and the debugger see
+ * it between two chunks.
+ */
+static void cpu_block(struct _machine *machine, uint8_t opcode, uint32_t instr)
+{
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+	uint16_t *rd = cpu_regs->GP_REG + ((instr >> 8) & 0xf);
+	uint16_t *rs = cpu_regs->GP_REG + ((instr >> 12) & 0xf);
+	uint16_t *rn = cpu_regs->GP_REG + ((instr >> 16) & 0xf);
+	uint32_t sbank = (instr >> 20) & 0xf;
+	uint32_t dst = MEM_BANK(cpu_regs->br, *rd);
+	uint32_t src = MEM_BANK(sbank ? (sbank - 1) : cpu_regs->br, *rs);
+	uint32_t len = *rn;
+	uint32_t chunk;
+	int diff;
+
+	debug_args(cpu_regs->dbg_info, cpu_regs->dbg_index, rd, rn);
+
+	if (((uint64_t)dst + len > RAM_SIZE) ||
+	    ((opcode != bfill) && ((uint64_t)src + len > RAM_SIZE)) ||
+	    ((opcode != bcomp) && (dst < MEM_START_RW))) {
+		cpu_regs->exception |= EXC_MEM;
+		return;
+	}
+
+	/* an empty block compares equal */
+	if (!len) {
+		if (opcode == bcomp)
+			cpu_regs->cr = COND_EQ | COND_ZERO;
+		return;
+	}
+
+	chunk = (len > CPU_BLOCK_CHUNK) ? CPU_BLOCK_CHUNK : len;
+
+	switch (opcode) {
+	case bmove:
+		/* copying upwards over itself must start at the end, do it at once */
+		if ((dst > src) && (dst < src + len))
+			chunk = len;
+
+		mmio_range(machine, MMIO_READ, src, chunk);
+		memmove(machine->RAM + dst, machine->RAM + src, chunk);
+		ram_mark_dirty(machine, dst, chunk);
+		mmio_range(machine, MMIO_WRITE, dst, chunk);
+		break;
+	case bfill:
+		memset(machine->RAM + dst, *rs & 0xff, chunk);
+		ram_mark_dirty(machine, dst, chunk);
+		mmio_range(machine, MMIO_WRITE, dst, chunk);
+		break;
+	case bcomp:
+		mmio_range(machine, MMIO_READ, dst, chunk);
+		mmio_range(machine, MMIO_READ, src, chunk);
+
+		diff = memcmp(machine->RAM + dst, machine->RAM + src, chunk);
+
+		cpu_regs->cr =
+			(diff == 0) ? (COND_EQ | COND_ZERO) :
+			(diff > 0) ? (COND_GR | COND_NEQ) :
+			(COND_LE | COND_NEQ);
+
+		if (diff)
+			return;
+		break;
+	}
+
+	*rd += chunk;
+	if (opcode != bfill)
+		*rs += chunk;
+	*rn -= chunk;
+
+	/* not done, run it again for the next chunk */
+	if (*rn)
+		cpu_regs->pc -= sizeof(uint32_t);
+
+	debug_result(cpu_regs->dbg_info, cpu_regs->dbg_index, chunk);
+}
+
+/*
+ * vadd .. vcmp and vsum. Checked and stepped like a block instruction,
+ * CPU_BLOCK_CHUNK bytes at a time, the lanes are done by vector.c.
+ */
+static void cpu_vector(struct _machine *machine, uint8_t opcode, uint32_t instr)
+{
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+	uint16_t *rd = cpu_regs->GP_REG + ((instr >> 8) & 0xf);
+	uint16_t *rs = cpu_regs->GP_REG + ((instr >> 12) & 0xf);
+	uint16_t *rn = cpu_regs->GP_REG + ((instr >> 16) & 0xf);
+	uint32_t shift = (instr & OP_VEC_WORD) ? 1 : 0;
+	uint32_t dst = MEM_BANK(cpu_regs->br, *rd);
+	uint32_t src = MEM_BANK(cpu_regs->br, *rs);
+	uint32_t len = (uint32_t)*rn << shift;
+	uint32_t chunk;
+
+	debug_args(cpu_regs->dbg_info, cpu_regs->dbg_index, rd, rn);
+
+	if (((uint64_t)src + len > RAM_SIZE) ||
+	    ((opcode != vsum) && (((uint64_t)dst + len > RAM_SIZE) || (dst < MEM_START_RW)))) {
+		cpu_regs->exception |= EXC_MEM;
+		return;
+	}
+
+	if (!len)
+		return;
+
+	chunk = (len > CPU_BLOCK_CHUNK) ? CPU_BLOCK_CHUNK : len;
+
+	mmio_range(machine, MMIO_READ, src, chunk);
+
+	if (opcode == vsum) {
+		*rd += shift ? vector_sum16(machine->RAM + src, chunk >> 1) :
+			vector_sum8(machine->RAM + src, chunk);
+	} else {
+		mmio_range(machine, MMIO_READ, dst, chunk);
+
+		if (shift)
+			vector_op16(opcode - vadd, machine->RAM + dst, machine->RAM + src, chunk >> 1);
+		else
+			vector_op8(opcode - vadd, machine->RAM + dst, machine->RAM + src, chunk);
+
+		ram_mark_dirty(machine, dst, chunk);
+		mmio_range(machine, MMIO_WRITE, dst, chunk);
+
+		*rd += chunk;
+	}
+
+	*rs += chunk;
+	*rn -= chunk >> shift;
+
+	/* not done, run it again for the next chunk */
+	if (*rn)
+		cpu_regs->pc -= sizeof(uint32_t);
+
+	debug_result(cpu_regs->dbg_info, cpu_regs->dbg_index, chunk);
+}
+
+/* a slot on the stack, always in bank 0. Out of this core's part of it is EXC_STACK */
+static __inline__ void cpu_push(struct _machine *machine, uint32_t val)
+{
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+
+	if ((cpu_regs->sp - MEM_STACK_SLOT < cpu_regs->stack_base) ||
+	    (cpu_regs->sp > cpu_regs->stack_top)) {
+		cpu_regs->exception |= EXC_STACK;
+		return;
+	}
+
+	cpu_regs->sp -= MEM_STACK_SLOT;
+	memcpy(machine->RAM + cpu_regs->sp, &val, MEM_STACK_SLOT);
+	ram_mark_dirty(machine, cpu_regs->sp, MEM_STACK_SLOT);
+}
+
+static __inline__ uint32_t cpu_pop(struct _machine *machine)
+{
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+	uint32_t val;
+
+	if ((cpu_regs->sp + MEM_STACK_SLOT > cpu_regs->stack_top) ||
+	    (cpu_regs->sp < cpu_regs->stack_base)) {
+		cpu_regs->exception |= EXC_STACK;
+		return 0;
+	}
+
+	memcpy(&val, machine->RAM + cpu_regs->sp, MEM_STACK_SLOT);
+	cpu_regs->sp += MEM_STACK_SLOT;
+
+	return val;
+}
+
+/* dst is either a register or a location in RAM */
+static __inline__ void cpu_store(struct _machine *machine, uint16_t *dst, uint16_t val)
+{
+	uintptr_t addr = (uintptr_t)dst - (uintptr_t)machine->RAM;
+
+	*dst = val;
+
+	if (addr < RAM_SIZE) {
+		ram_mark_dirty(machine, addr, sizeof(uint16_t));
+		mmio_write(machine, addr, sizeof(uint16_t));
+	}
+}
+
+/*
+ * mul up to sar. Both operands and the result are 16 bit, a memory
+ * destination is read through its device like a memory source.
+ */
+static void cpu_alu(struct _machine *machine, uint8_t opcode, uint32_t *instr)
+{
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+	uint16_t *dst;
+	uint16_t src;
+	uint16_t val;
+
+	if (!(*instr & (OP_DST_REG | OP_DST_MEM))) {
+		cpu_regs->exception |= EXC_INSTR;
+		return;
+	}
+
+	src = cpu_decode_mnemonic(machine, instr, &dst, SIZE_INT);
+	if (cpu_regs->exception)
+		return;
+
+	if (*instr & OP_DST_MEM)
+		mmio_read(machine, (uint8_t *)dst - machine->RAM, sizeof(uint16_t));
+
+	switch (opcode) {
+	case mul:
+		val = (uint32_t)*dst * src;
+		break;
+	case divu:
+	case modu:
+		if (!src) {
+			cpu_regs->exception |= EXC_DIV;
+			return;
+		}
+		val = (opcode == divu) ? (*dst / src) : (*dst % src);
+		break;
+	case and:
+		val = *dst & src;
+		break;
+	case or:
+		val = *dst | src;
+		break;
+	case xor:
+		val = *dst ^ src;
+		break;
+	case not:
+		val = ~*dst;
+		break;
+	case shl:
+		val = *dst << (src & 0xf);
+		break;
+	case shr:
+		val = *dst >> (src & 0xf);
+		break;
+	default: /* sar */
+		val = (int16_t)*dst >> (src & 0xf);
+		break;
+	}
+
+	debug_result(cpu_regs->dbg_info, cpu_regs->dbg_index, val);
+
+	cpu_store(machine, dst, val);
+}
+
+/*
+ * ldb, ldw, stb and stw: base register plus a signed offset, or the base
+ * alone and the offset added to it afterwards. Past RAM is caught by the
+ * guard.
+ */
+static void cpu_ldst(struct _machine *machine, uint8_t opcode, uint32_t instr)
+{
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+	uint16_t *reg = cpu_regs->GP_REG + ((instr >> 8) & 0xf);
+	uint16_t *base = cpu_regs->GP_REG + ((instr >> 12) & 0xf);
+	int32_t offset = OP_LDST_OFFSET(instr);
+	uint32_t size = ((opcode == ldw) || (opcode == stw)) ? 2 : 1;
+	uint16_t val = *reg;
+	uint32_t addr;
+
+	if (instr & OP_LDST_POST)
+		addr = MEM_BANK(cpu_regs->br, *base);
+	else
+		addr = MEM_BANK(cpu_regs->br, (uint16_t)(*base + offset));
+
+	debug_args(cpu_regs->dbg_info, cpu_regs->dbg_index, reg, base);
+
+	switch (opcode) {
+	case ldb:
+	case ldw:
+		mmio_read(machine, addr, size);
+		val = machine->RAM[addr];
+		if (size == 2)
+			val |= machine->RAM[addr + 1] << 8;
+		break;
+	default:
+		if (addr < MEM_START_RW) {
+			cpu_regs->exception |= EXC_MEM;
+			return;
+		}
+		machine->RAM[addr] = val & 0xff;
+		if (size == 2)
+			machine->RAM[addr + 1] = val >> 8;
+		ram_mark_dirty(machine, addr, size);
+		mmio_write(machine, addr, size);
+		break;
+	}
+
+	if (instr & OP_LDST_POST)
+		*base += offset;
+
+	if ((opcode == ldb) || (opcode == ldw))
+		*reg = val;
+
+	debug_result(cpu_regs->dbg_info, cpu_regs->dbg_index, val);
+}
+
+/*
+ * cas and xadd, on a word other cores may use at the same time. Done with
+ * host atomics, sequentially consistent, so they also order the plain
+ * loads and stores on either side of them.
+ */
+static void cpu_atomic(struct _machine *machine, uint8_t opcode, uint32_t instr)
+{
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+	uint16_t *rx = cpu_regs->GP_REG + ((instr >> 8) & 0xf);
+	uint16_t *ra = cpu_regs->GP_REG + ((instr >> 12) & 0xf);
+	uint16_t *rn = cpu_regs->GP_REG + ((instr >> 16) & 0xf);
+	uint32_t addr = MEM_BANK(cpu_regs->br, *ra);
+	uint16_t old = *rx;
+	uint16_t *word;
+
+	debug_args(cpu_regs->dbg_info, cpu_regs->dbg_index, rx, ra);
+
+	if ((addr & 1) || (addr < MEM_START_RW) || (addr + sizeof(uint16_t) > RAM_SIZE)) {
+		cpu_regs->exception |= EXC_MEM;
+		return;
+	}
+
+	word = (uint16_t *)(machine->RAM + addr);
+
+	mmio_read(machine, addr, sizeof(uint16_t));
+
+	if (opcode == xadd) {
+		*rx = __atomic_fetch_add(word, *rx, __ATOMIC_SEQ_CST);
+	} else if (__atomic_compare_exchange_n(word, &old, *rn, 0,
+		   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		cpu_regs->cr = COND_EQ | COND_ZERO;
+	} else {
+		*rx = old;
+		cpu_regs->cr = COND_NEQ;
+		debug_result(cpu_regs->dbg_info, cpu_regs->dbg_index, old);
+		return;
+	}
+
+	ram_mark_dirty(machine, addr, sizeof(uint16_t));
+	mmio_write(machine, addr, sizeof(uint16_t));
+
+	debug_result(cpu_regs->dbg_info, cpu_regs->dbg_index, *rx);
+}
+
 static void cpu_decode_instruction(void *mach)
 {
 	struct _machine *machine = mach;
@@ -131,6 +498,7 @@ static void cpu_decode_instruction(void *mach)
 	uint16_t src;
 	uint16_t *dst;
 	uint16_t addr;
+	uint32_t target;
 	uint16_t arg1;
 	uint16_t arg2;
 
@@ -139,44 +507,84 @@ static void cpu_decode_instruction(void *mach)
 
 	instr = (uint32_t *)&machine->RAM[machine->cpu_regs.pc];
 
-	debug_instr(dbg_info, dbg_index, instr);
+	debug_instr(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, instr);
 
 	opcode = *instr & 0xff;
 
 	switch(opcode) {
 		case nop:
-			debug_opcode(dbg_info, dbg_index, "nop");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "nop");
 			break;
 		case halt:
-			debug_opcode(dbg_info, dbg_index, "halt");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "halt");
 			machine->cpu_regs.panic = 1;
 			break;
 		case mov:
-			debug_opcode(dbg_info, dbg_index, "mov");
-			src = cpu_decode_mnemonic(&machine->cpu_regs, machine->RAM, instr, &dst, SIZE_BYTE);
-			if (!machine->cpu_regs.exception);
-				*dst = src;
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "mov");
+			src = cpu_decode_mnemonic(machine, instr, &dst, SIZE_BYTE);
+			if (!machine->cpu_regs.exception)
+				cpu_store(machine, dst, src);
 			break;
 		case movi:
-			debug_opcode(dbg_info, dbg_index, "movi");
-			src = cpu_decode_mnemonic(&machine->cpu_regs, machine->RAM, instr, &dst, SIZE_INT);
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "movi");
+			src = cpu_decode_mnemonic(machine, instr, &dst, SIZE_INT);
 			if (!machine->cpu_regs.exception)
-				*dst = src;
+				cpu_store(machine, dst, src);
 			break;
 		case add:
-			debug_opcode(dbg_info, dbg_index, "add");
-			src = cpu_decode_mnemonic(&machine->cpu_regs, machine->RAM, instr, &dst,SIZE_BYTE);
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "add");
+			src = cpu_decode_mnemonic(machine, instr, &dst,SIZE_BYTE);
 			if (!machine->cpu_regs.exception)
-				*dst += src;
+				cpu_store(machine, dst, *dst + src);
 			break;
 		case sub:
-			debug_opcode(dbg_info, dbg_index, "sub");
-			src = cpu_decode_mnemonic(&machine->cpu_regs, machine->RAM, instr, &dst,SIZE_BYTE);
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "sub");
+			src = cpu_decode_mnemonic(machine, instr, &dst,SIZE_BYTE);
 			if (!machine->cpu_regs.exception)
-				*dst -= src;
+				cpu_store(machine, dst, *dst - src);
+			break;
+		case mul:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "mul");
+			cpu_alu(machine, opcode, instr);
+			break;
+		case divu:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "divu");
+			cpu_alu(machine, opcode, instr);
+			break;
+		case modu:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "modu");
+			cpu_alu(machine, opcode, instr);
+			break;
+		case and:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "and");
+			cpu_alu(machine, opcode, instr);
+			break;
+		case or:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "or");
+			cpu_alu(machine, opcode, instr);
+			break;
+		case xor:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "xor");
+			cpu_alu(machine, opcode, instr);
+			break;
+		case not:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "not");
+			cpu_alu(machine, opcode, instr);
+			break;
+		case shl:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "shl");
+			cpu_alu(machine, opcode, instr);
+			break;
+		case shr:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "shr");
+			cpu_alu(machine, opcode, instr);
+			break;
+		case sar:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "sar");
+			cpu_alu(machine, opcode, instr);
 			break;
 		case jmp:
-			debug_opcode(dbg_info, dbg_index, "jmp");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "jmp");
 			if ((*instr >> 8) > MEM_START_ROM) {
 				machine->cpu_regs.pc = (*instr >> 8) - sizeof(uint32_t); /* compensate for pc++ */
 			} else {
@@ -186,18 +594,55 @@ static void cpu_decode_instruction(void *mach)
 					machine->cpu_regs.pc = machine->cpu_regs.GP_REG[(*instr >> 8)] - sizeof(uint32_t);
 			}
 
-			debug_result(dbg_info, dbg_index, machine->cpu_regs.pc);
+			debug_result(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, machine->cpu_regs.pc);
+			break;
+		case call:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "call");
+			target = *instr >> 8;
+			if (target <= MEM_START_ROM) {
+				if (target > GP_REG_MAX) {
+					machine->cpu_regs.exception |= EXC_MEM;
+					break;
+				}
+				target = machine->cpu_regs.GP_REG[target];
+			}
+			cpu_push(machine, machine->cpu_regs.pc);
+			if (!machine->cpu_regs.exception)
+				machine->cpu_regs.pc = target - sizeof(uint32_t); /* compensate for pc++ */
+			debug_result(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, machine->cpu_regs.pc);
+			break;
+		case rts:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "rts");
+			target = cpu_pop(machine);
+			if (!machine->cpu_regs.exception)
+				machine->cpu_regs.pc = target;
+			debug_result(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, machine->cpu_regs.pc);
+			break;
+		case push:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "push");
+			arg1 = (*instr >> 8) & 0xf;
+			debug_args(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, &arg1, &machine->cpu_regs.GP_REG[arg1]);
+			cpu_push(machine, machine->cpu_regs.GP_REG[arg1]);
+			debug_result(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, machine->cpu_regs.sp);
+			break;
+		case pop:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "pop");
+			arg1 = (*instr >> 8) & 0xf;
+			target = cpu_pop(machine);
+			if (!machine->cpu_regs.exception)
+				machine->cpu_regs.GP_REG[arg1] = target;
+			debug_result(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, machine->cpu_regs.GP_REG[arg1]);
 			break;
 		case cmp:
-			debug_opcode(dbg_info, dbg_index, "cmp");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "cmp");
 			machine->cpu_regs.cr &= COND_UNDEF;
-			src = cpu_decode_mnemonic(&machine->cpu_regs, machine->RAM, instr, &dst, SIZE_INT);
+			src = cpu_decode_mnemonic(machine, instr, &dst, SIZE_INT);
 			compare(&machine->cpu_regs, src, *dst);
-			debug_args(dbg_info, dbg_index, &src, dst);
-			debug_result(dbg_info, dbg_index, (unsigned long)machine->cpu_regs.cr);
+			debug_args(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, &src, dst);
+			debug_result(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, (unsigned long)machine->cpu_regs.cr);
 			break;
 		case breq:
-			debug_opcode(dbg_info, dbg_index, "breq");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "breq");
 			addr = (*instr >> 16);
 			if (addr > MEM_START_ROM)
 				branch(&machine->cpu_regs, COND_EQ, (*instr >> 16));
@@ -209,7 +654,7 @@ static void cpu_decode_instruction(void *mach)
 			}
 			break;
 		case brneq:
-			debug_opcode(dbg_info, dbg_index, "brneq");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "brneq");
 			addr = (*instr >> 16);
 			if (addr > MEM_START_ROM)
 				branch(&machine->cpu_regs, COND_NEQ, (*instr >> 16));
@@ -221,54 +666,172 @@ static void cpu_decode_instruction(void *mach)
 			}
 			break;
 		case stopc:
-			debug_opcode(dbg_info, dbg_index, "stopc");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "stopc");
 			addr = (*instr >> 8);
-			debug_args(dbg_info, dbg_index, &addr, NULL);
-			debug_result(dbg_info, dbg_index, machine->cpu_regs.pc);
+			debug_args(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, &addr, NULL);
+			debug_result(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, machine->cpu_regs.pc);
 			machine->cpu_regs.GP_REG[(*instr >> 8)] = machine->cpu_regs.pc;
 			break;
 		case rst:
-			debug_opcode(dbg_info, dbg_index, "rst");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "rst");
 			machine->cpu_regs.exception |= EXC_PRG;
 			break;
 		case movmr:
 			arg1 = (*instr >> 8) & 0xf;
 			arg2 = machine->cpu_regs.GP_REG[(*instr >> 12) & 0xf];
-			debug_opcode(dbg_info, dbg_index, "movmr");
-			debug_args(dbg_info, dbg_index, &arg1, &arg2);
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "movmr");
+			debug_args(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, &arg1, &arg2);
 			if ((arg1 > GP_REG_MAX))
 				machine->cpu_regs.exception |= EXC_MEM;
 			else {
-				machine->cpu_regs.GP_REG[arg1] = machine->RAM[arg2];
-				debug_result(dbg_info, dbg_index,  machine->cpu_regs.GP_REG[arg1]);
+				mmio_read(machine, MEM_BANK(machine->cpu_regs.br, arg2), 1);
+				machine->cpu_regs.GP_REG[arg1] =
+					machine->RAM[MEM_BANK(machine->cpu_regs.br, arg2)];
+				debug_result(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index,  machine->cpu_regs.GP_REG[arg1]);
+			}
+			break;
+		case bank:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "bank");
+			arg1 = (*instr >> 16) & 0xffff;
+			if (*instr & OP_SRC_REG) {
+				if (arg1 > GP_REG_MAX) {
+					machine->cpu_regs.exception |= EXC_REG;
+					break;
+				}
+				arg1 = machine->cpu_regs.GP_REG[arg1];
+			}
+			/* a bank past RAM faults on its first access */
+			machine->cpu_regs.br = arg1;
+			debug_result(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, arg1);
+			break;
+		case ei:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "ei");
+			machine->cpu_regs.ie = 1;
+			break;
+		case di:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "di");
+			machine->cpu_regs.ie = 0;
+			break;
+		case reti:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "reti");
+			machine->cpu_regs.pc = machine->cpu_regs.epc;
+			machine->cpu_regs.cr = machine->cpu_regs.ecr;
+			machine->cpu_regs.br = machine->cpu_regs.ebr;
+			machine->cpu_regs.ie = 1;
+			machine->intc->active = IRQ_NONE;
+			debug_result(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, machine->cpu_regs.pc);
+			break;
+		case wfi:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "wfi");
+			/* counted first, an event from here on ends the wait */
+			machine->wait.seen = __atomic_load_n(&machine->wait.events, __ATOMIC_SEQ_CST);
+			if (!(machine->intc->pending & machine->intc->mask)) {
+				machine->cpu_regs.waiting = CPU_WAIT_WFI;
+				machine->cpu_regs.idle = 0;
 			}
 			break;
+		case bmove:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "bmove");
+			cpu_block(machine, opcode, *instr);
+			break;
+		case bfill:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "bfill");
+			cpu_block(machine, opcode, *instr);
+			break;
+		case bcomp:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "bcomp");
+			cpu_block(machine, opcode, *instr);
+			break;
+		case ldb:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "ldb");
+			cpu_ldst(machine, opcode, *instr);
+			break;
+		case ldw:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "ldw");
+			cpu_ldst(machine, opcode, *instr);
+			break;
+		case stb:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "stb");
+			cpu_ldst(machine, opcode, *instr);
+			break;
+		case stw:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "stw");
+			cpu_ldst(machine, opcode, *instr);
+			break;
+		case vadd:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "vadd");
+			cpu_vector(machine, opcode, *instr);
+			break;
+		case vsub:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "vsub");
+			cpu_vector(machine, opcode, *instr);
+			break;
+		case vmin:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "vmin");
+			cpu_vector(machine, opcode, *instr);
+			break;
+		case vmax:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "vmax");
+			cpu_vector(machine, opcode, *instr);
+			break;
+		case vcmp:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "vcmp");
+			cpu_vector(machine, opcode, *instr);
+			break;
+		case vsum:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "vsum");
+			cpu_vector(machine, opcode, *instr);
+			break;
+		case hcall:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "hcall");
+			hcall_dispatch(machine, (*instr >> 8) & 0xff);
+			break;
+		case cpuid:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "cpuid");
+			machine->cpu_regs.GP_REG[(*instr >> 8) & 0xf] = machine->cpu_regs.core;
+			break;
+		case cstart:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "cstart");
+			if (smp_start(machine, machine->cpu_regs.GP_REG[(*instr >> 8) & 0xf],
+			    machine->cpu_regs.GP_REG[(*instr >> 12) & 0xf]))
+				machine->cpu_regs.cr = COND_EQ | COND_ZERO;
+			else
+				machine->cpu_regs.cr = COND_NEQ;
+			break;
+		case cas:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "cas");
+			cpu_atomic(machine, opcode, *instr);
+			break;
+		case xadd:
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "xadd");
+			cpu_atomic(machine, opcode, *instr);
+			break;
 		case diwait:
-			debug_opcode(dbg_info, dbg_index, "diwait");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "diwait");
 			machine->cpu_regs.vdc_request = 1;
 			break;
 		case dimd:
-			debug_opcode(dbg_info, dbg_index, "dimd");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "dimd");
 			machine->cpu_regs.vdc_request = 1;
 			break;
 		case diclr:
-			debug_opcode(dbg_info, dbg_index, "diclr");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "diclr");
 			machine->cpu_regs.vdc_request = 1;
 			break;
 		case diwtrt:
-			debug_opcode(dbg_info, dbg_index, "diwtrt");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "diwtrt");
 			machine->cpu_regs.vdc_request = 1;
 			break;
 		case disetxy:
-			debug_opcode(dbg_info, dbg_index, "setposxy");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "setposxy");
 			machine->cpu_regs.vdc_request = 1;
 			break;
 		case dichar:
-			debug_opcode(dbg_info, dbg_index, "putchar");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "putchar");
 			machine->cpu_regs.vdc_request = 1;
 			break;
 		case diputpixel:
-			debug_opcode(dbg_info, dbg_index, "putpixel");
+			debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index, "putpixel");
 			machine->cpu_regs.vdc_request = 1;
 			break;
 		default: machine->cpu_regs.exception |= EXC_INSTR;
@@ -280,7 +843,7 @@ static void cpu_decode_instruction(void *mach)
 			usleep(1000);
 		machine->vdc_regs.display.enabled = 0;
 		vdc_gotoxy(1,15);
-		dump_instr(dbg_info, dbg_index);
+		dump_instr(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index);
 		vdc_gotoxy(1,15 + DBG_HISTORY + 4);
 		dump_regs(machine->cpu_regs.GP_REG);
 		machine->vdc_regs.display.enabled = 1; /* fixme: bug*/
@@ -321,6 +884,12 @@ static void cpu_handle_exception(void *mach)
 			case EXC_IOPORT:
 				printf("* I/O error\n");
 			break;
+			case EXC_STACK:
+				printf("* Stack overflow or underflow\n");
+			break;
+			case EXC_DIV:
+				printf("* Division by zero\n");
+			break;
 			case EXC_SHUTDOWN:
 				printf("* Machine shutdown\n");
 			break;
@@ -334,15 +903,303 @@ static void cpu_handle_exception(void *mach)
 	printf("[pc: %lu]\n", machine->cpu_regs.pc);
 }
 
+/*
+ * A guest access outside of RAM hits the guard behind it. The instruction
+ * is abandoned and cpu_run() raises the exception with pc still on it, a
+ * fetch past RAM is a stray program.
+ */
+static void cpu_fault_handler(int signo, siginfo_t *info, void *ctx)
+{
+	struct _machine *machine = cpu_current;
+
+	if (machine && ram_guard_hit(machine->RAM, info->si_addr)) {
+		if (((uintptr_t)info->si_addr -
+		    (uintptr_t)(machine->RAM + machine->cpu_regs.pc)) < sizeof(uint32_t))
+			machine->cpu_regs.exception |= EXC_PRG;
+		else
+			machine->cpu_regs.exception |= EXC_MEM;
+
+		siglongjmp(cpu_fault, 1);
+	}
+
+	/* not a guest access, crash as usual */
+	signal(SIGSEGV, SIG_DFL);
+}
+
+void cpu_fault_setup(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0x00, sizeof(sa));
+	sa.sa_sigaction = cpu_fault_handler;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+
+	sigaction(SIGSEGV, &sa, NULL);
+}
+
+/*
+ * Take the highest priority line that is pending and not masked. pc still
+ * points at the last instruction, reti puts it back and the fetch moves
+ * on as if nothing happened. A block instruction that is not done yet
+ * runs again.
+ */
+static void cpu_interrupt(struct _machine *machine)
+{
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+	struct _intc_regs *intc = machine->intc;
+	unsigned int line = __builtin_ctz(intc->pending & intc->mask);
+
+	if (!intc->vector[line]) {
+		cpu_regs->exception |= EXC_PRG;
+		return;
+	}
+
+	cpu_regs->epc = cpu_regs->pc;
+	cpu_regs->ecr = cpu_regs->cr;
+	cpu_regs->ebr = cpu_regs->br;
+	cpu_regs->ie = 0;
+	cpu_regs->br = 0;
+
+	/* the handler may change memory the loop looks at */
+	cpu_regs->spin.pc = 0;
+
+	intc->active = line;
+	ram_mark_dirty(machine, MEM_INTC_CORE(machine->cpu_regs.core), sizeof(struct _intc_regs));
+
+	cpu_regs->pc = intc->vector[line] - sizeof(uint32_t);
+}
+
+/*
+ * True once something ended the wait. A line that is not masked ends a
+ * wfi, a polling loop only ends on it if it would be taken.
+ */
+static __inline__ int cpu_wfi_done(struct _machine *machine)
+{
+	uint16_t lines = machine->intc->pending & machine->intc->mask;
+
+	if ((machine->cpu_regs.waiting == CPU_WAIT_SPIN) && !machine->cpu_regs.ie)
+		lines = 0;
+
+	if ((__atomic_load_n(&machine->wait.events, __ATOMIC_ACQUIRE) == machine->wait.seen) &&
+	    !lines && !machine->cpu_regs.exception)
+		return 0;
+
+	machine->cpu_regs.waiting = 0;
+	return 1;
+}
+
+/*
+ * Nothing woke the cpu yet. Move the instruction count on to the next
+ * thing that can: the timer once its time has been waited, or the next
+ * input when running from the log. Returns 0 if there is nothing to
+ * move to.
+ */
+static int cpu_wfi_skip(struct _machine *machine)
+{
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+	uint64_t due = machine->timer->due;
+	uint64_t next;
+
+	if (replay_next(machine, &next)) {
+		if (due < next)
+			next = due;
+		if (next == UINT64_MAX)
+			return 0;
+	} else {
+		if ((due == TIMER_OFF) || (cpu_regs->idle < due - cpu_regs->icount))
+			return 0;
+		next = due;
+	}
+
+	cpu_regs->icount = next;
+	cpu_regs->idle = 0;
+
+	return 1;
+}
+
+/*
+ * Same for a polling loop, but the loop still runs in guest time. The
+ * count moves on by whole rounds, to the last one that starts before the
+ * timer, the next logged input or, live, the time waited. The rest is
+ * run for real, so everything happens on the same instruction as it
+ * would without the skip.
+ */
+static int cpu_spin_skip(struct _machine *machine)
+{
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+	uint64_t next = machine->timer->due;
+	uint64_t logged, skip;
+	int early = 0;
+
+	if (replay_next(machine, &logged)) {
+		if (logged < next)
+			next = logged;
+	} else if (cpu_regs->idle < next - cpu_regs->icount) {
+		next = cpu_regs->icount + cpu_regs->idle;
+		early = 1;
+	}
+
+	if (next == UINT64_MAX)
+		return 0;
+
+	skip = next - cpu_regs->icount;
+	skip -= skip % cpu_regs->spin.len;
+
+	if (!skip) {
+		if (early)
+			return 0;
+
+		/* due within this round */
+		cpu_regs->waiting = 0;
+		return 1;
+	}
+
+	/* the skipped rounds count as run */
+	cpu_regs->icount += skip;
+	cpu_regs->retired += skip;
+	cpu_regs->idle = (cpu_regs->idle > skip) ? cpu_regs->idle - skip : 0;
+
+	return 1;
+}
+
+/* what a polling loop may be made of: no stores, no devices started */
+static int cpu_spin_pure(struct _machine *machine, unsigned long from, unsigned long to)
+{
+	for (unsigned long addr = from; addr <= to; addr += sizeof(uint32_t)) {
+		uint32_t instr = *(uint32_t *)&machine->RAM[addr];
+
+		switch (instr & 0xff) {
+		case mov:
+		case movi:
+		case add:
+		case sub:
+		case mul:
+		case divu:
+		case modu:
+		case and:
+		case or:
+		case xor:
+		case not:
+		case shl:
+		case shr:
+		case sar:
+			if (!(instr & OP_DST_REG))
+				return 0;
+			break;
+		case nop:
+		case cmp:
+		case movmr:
+		case ldb:
+		case ldw:
+		case breq:
+		case brneq:
+		case jmp:
+		case stopc:
+		case diwait:
+		case diwtrt:
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Called when the instruction at from branched back. A loop that went
+ * round twice with the same registers, without a store and without a
+ * device event in between, reads the same memory every round and can
+ * only be ended by a device. It then waits like a wfi. Device registers
+ * with a read handler forget the loop, see mmio_dispatch().
+ */
+static void cpu_spin_check(struct _machine *machine, unsigned long from)
+{
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+	struct _cpu_spin *spin = &cpu_regs->spin;
+	unsigned int events = __atomic_load_n(&machine->wait.events, __ATOMIC_ACQUIRE);
+
+	if ((spin->pc == from) && (spin->events == events) &&
+	    (spin->cr == cpu_regs->cr) && (spin->br == cpu_regs->br) &&
+	    !memcmp(spin->GP_REG, cpu_regs->GP_REG, sizeof(spin->GP_REG)) &&
+	    !(machine->dma->status & DMA_STATUS_BUSY) &&
+	    ((from - cpu_regs->pc) <= CPU_SPIN_MAX * sizeof(uint32_t)) &&
+	    cpu_spin_pure(machine, cpu_regs->pc + sizeof(uint32_t), from)) {
+		spin->len = cpu_regs->icount - spin->icount;
+		spin->pc = 0;
+
+		machine->wait.seen = events;
+		cpu_regs->waiting = CPU_WAIT_SPIN;
+		cpu_regs->idle = 0;
+		return;
+	}
+
+	spin->pc = from;
+	spin->icount = cpu_regs->icount;
+	spin->events = events;
+	spin->cr = cpu_regs->cr;
+	spin->br = cpu_regs->br;
+	memcpy(spin->GP_REG, cpu_regs->GP_REG, sizeof(spin->GP_REG));
+}
+
+void cpu_init(void *mach)
+{
+	struct _machine *machine = mach;
+
+	pthread_mutex_init(&machine->wait.lock, NULL);
+	pthread_cond_init(&machine->wait.cond, NULL);
+}
+
+/* a device event, ends a wfi or a polling loop. May be called from any thread */
+void cpu_event(void *mach)
+{
+	struct _machine *machine = mach;
+
+	__atomic_add_fetch(&machine->wait.events, 1, __ATOMIC_SEQ_CST);
+	cpu_kick(machine);
+}
+
+/* wake a sleeping cpu to look at new input */
+void cpu_kick(void *mach)
+{
+	struct _machine *machine = mach;
+
+	pthread_mutex_lock(&machine->wait.lock);
+	machine->wait.kick = 1;
+	pthread_cond_signal(&machine->wait.cond);
+	pthread_mutex_unlock(&machine->wait.lock);
+}
+
+/* instruction times that passed while the cpu waited */
+void cpu_idle(void *mach, uint64_t periods)
+{
+	struct _machine *machine = mach;
+	uint64_t idle = machine->cpu_regs.idle;
+
+	machine->cpu_regs.idle = (periods > UINT64_MAX - idle) ? UINT64_MAX : idle + periods;
+}
+
+/*
+ * The instruction has to wait for a device. It runs again on the next
+ * cycle and only retires once it got through.
+ */
+void cpu_stall(void *mach)
+{
+	struct _machine *machine = mach;
+
+	machine->cpu_regs.pc -= sizeof(uint32_t);
+	machine->cpu_regs.stalled = 1;
+	machine->counters.stalls++;
+}
+
 static void cpu_fetch_instruction(struct _cpu_regs *cpu_regs)
 {
-	/* each instruction is 4 bytes */
+	/* each instruction is 4 bytes, past RAM is caught by the guard */
 	cpu_regs->pc += sizeof(uint32_t);
-	if (cpu_regs->pc >= (RAM_SIZE - 3))
-		cpu_regs->exception = EXC_PRG;
 
-	dbg_index = (dbg_index + 1) % DBG_HISTORY;
-	memset(dbg_info + dbg_index, 0x00, sizeof(struct _dbg));
+	cpu_regs->dbg_index = (cpu_regs->dbg_index + 1) % DBG_HISTORY;
+	memset(cpu_regs->dbg_info + cpu_regs->dbg_index, 0x00, sizeof(struct _dbg));
 
 	cpu_regs->vdc_request = 0;
 }
@@ -350,28 +1207,186 @@ static void cpu_fetch_instruction(struct _cpu_regs *cpu_regs)
 void cpu_reset(void *mach)
 {
 	struct _machine *machine = mach;
+	int slice = (MEM_STACK_TOP - MEM_START_STACK) / (machine->smp ? machine->smp->cores : 1);
+
+	memset(machine->cpu_regs.GP_REG, 0x00, sizeof(machine->cpu_regs.GP_REG));
 
-	memset(machine->cpu_regs.GP_REG, 0x00, GP_REG_MAX);
+	/* the cores split the stack, core 0 at the top */
+	slice &= ~(MEM_STACK_SLOT - 1);
 
 	machine->cpu_regs.reset = 1;
-	machine->cpu_regs.sp = 0;
+	machine->cpu_regs.stack_top = MEM_STACK_TOP - machine->cpu_regs.core * slice;
+	machine->cpu_regs.stack_base = machine->cpu_regs.stack_top - slice;
+	machine->cpu_regs.sp = machine->cpu_regs.stack_top;
 	machine->cpu_regs.exception = EXC_NONE;
 	machine->cpu_regs.panic = 0;
 	machine->cpu_regs.cr = COND_UNDEF;
+	machine->cpu_regs.br = 0;
+	machine->cpu_regs.ie = 0;
+	machine->cpu_regs.waiting = 0;
+	machine->cpu_regs.idle = 0;
+	machine->cpu_regs.spin.pc = 0;
+	machine->cpu_regs.epc = 0;
+	machine->cpu_regs.ecr = COND_UNDEF;
+	machine->cpu_regs.ebr = 0;
 	machine->cpu_regs.dbg = 0;
 	machine->cpu_regs.vdc_request = 0;
 	machine->cpu_regs.pc = MACHINE_RESET_VECTOR;
+	machine->cpu_regs.icount = 0;
+	machine->cpu_regs.retired = 0;
+	machine->cpu_regs.stalled = 0;
 	machine->cpu_regs.mclk = MACHINE_MASTER_CLOCK / 20; /* 70 Hz */
 
-	// (if regs->dbg)
-	for (int d=0; d < DBG_HISTORY; d++)
-		memset(dbg_info + d, 0x00, sizeof(struct _dbg));
+	memset(machine->cpu_regs.dbg_info, 0x00, sizeof(machine->cpu_regs.dbg_info));
 
-	dbg_index = 0;
+	machine->cpu_regs.dbg_index = 0;
 
 }
 
 
+/*
+ * Run at most instr_count instructions back to back without any clock
+ * throttling. Returns the number of instructions executed, which is less
+ * than requested if the cpu halts or is held in reset.
+ */
+unsigned int cpu_run(void *mach, unsigned int instr_count)
+{
+	struct _machine *machine = mach;
+	volatile unsigned int executed = 0;
+	unsigned long from;
+
+	cpu_current = machine;
+
+	/* back from cpu_fault_handler() */
+	if (sigsetjmp(cpu_fault, 0)) {
+		cpu_handle_exception(machine);
+		machine->cpu_regs.icount++;
+		executed++;
+	}
+
+	while (executed < instr_count) {
+		/* may put the machine somewhere else in time */
+		if (machine->rewind)
+			rewind_poll(machine);
+
+		if (machine->replay)
+			replay_sync(machine);
+		else if (__atomic_load_n(&machine->signals, __ATOMIC_ACQUIRE))
+			replay_signals(machine);
+
+		if (machine->snapshot)
+			snapshot_poll(machine);
+
+		if (machine->cpu_regs.panic || machine->cpu_regs.reset)
+			break;
+
+		if (machine->cpu_regs.icount >= machine->timer->due)
+			timer_expire(machine);
+
+		/* the count stands still while waiting, it only skips ahead */
+		if (machine->cpu_regs.waiting && !cpu_wfi_done(machine)) {
+			if ((machine->cpu_regs.waiting == CPU_WAIT_SPIN) ?
+			    cpu_spin_skip(machine) : cpu_wfi_skip(machine))
+				continue;
+			break;
+		}
+
+		if (machine->cpu_regs.ie && (machine->intc->pending & machine->intc->mask)) {
+			cpu_interrupt(machine);
+
+			if (machine->cpu_regs.exception) {
+				cpu_handle_exception(machine);
+				break;
+			}
+		}
+
+		cpu_fetch_instruction(&machine->cpu_regs);
+		from = machine->cpu_regs.pc;
+		cpu_decode_instruction(machine);
+
+		/*
+		 * The debugger steps every instruction, no skipping there. With
+		 * more cores a store from another one can end any loop.
+		 */
+		if ((machine->cpu_regs.pc < from) && !machine->cpu_regs.exception &&
+		    !machine->rewind && !machine->smp)
+			cpu_spin_check(machine, from);
+
+		/* a full instruction list waits for the vdc to catch up, only core 0 has one */
+		if (machine->cpu_regs.vdc_request) {
+			if (machine->cpu_regs.core)
+				machine->cpu_regs.exception |= EXC_INSTR;
+			else if (vdc_add_instr(&machine->vdc_regs,
+			    (uint32_t *)&machine->RAM[machine->cpu_regs.pc]) != EXC_NONE)
+				cpu_stall(machine);
+			else if (machine->vdc_regs.sync)
+				vdc_run(machine);
+		}
+
+		if (machine->dma->status & DMA_STATUS_BUSY)
+			dma_step(machine);
+
+		if (machine->cpu_regs.exception)
+			cpu_handle_exception(machine);
+
+		if (machine->cpu_regs.stalled)
+			machine->cpu_regs.stalled = 0;
+		else
+			machine->cpu_regs.retired++;
+
+		machine->cpu_regs.icount++;
+		executed++;
+	}
+
+	cpu_current = NULL;
+
+	return executed;
+}
+
+/*
+ * Sleep while the cpu waits in wfi or in a polling loop, until an event,
+ * new input or the wall time the timer is due in. The time slept is
+ * handed to the timer.
+ */
+void cpu_wait(void *mach)
+{
+	struct _machine *machine = mach;
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+	uint64_t ns = CPU_WAIT_MS * 1000000ULL;
+	uint64_t due = machine->timer->due;
+	struct timespec start, stop, timeout;
+
+	if (due != TIMER_OFF) {
+		uint64_t left = due - cpu_regs->icount;
+
+		left = (left > cpu_regs->idle) ? left - cpu_regs->idle : 0;
+		if (left < (ns / 1000000) * cpu_regs->mclk / 1000)
+			ns = left * 1000000000ULL / cpu_regs->mclk;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	clock_gettime(CLOCK_REALTIME, &timeout);
+	timeout.tv_sec += (timeout.tv_nsec + ns) / 1000000000ULL;
+	timeout.tv_nsec = (timeout.tv_nsec + ns) % 1000000000ULL;
+
+	pthread_mutex_lock(&machine->wait.lock);
+
+	while (!machine->wait.kick &&
+	       (__atomic_load_n(&machine->wait.events, __ATOMIC_ACQUIRE) == machine->wait.seen) &&
+	       !cpu_regs->exception && !cpu_regs->panic) {
+		if (pthread_cond_timedwait(&machine->wait.cond, &machine->wait.lock, &timeout))
+			break;
+	}
+	machine->wait.kick = 0;
+
+	pthread_mutex_unlock(&machine->wait.lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	cpu_idle(machine, ((stop.tv_sec - start.tv_sec) * 1000000000ULL +
+		stop.tv_nsec - start.tv_nsec) * cpu_regs->mclk / 1000000000ULL);
+}
+
 void *cpu_machine(void *mach)
 {
 	struct _machine *machine = mach;
@@ -387,21 +1402,15 @@ void *cpu_machine(void *mach)
 			nanosleep(&cpu_clk_freq, NULL);
 		}
 
-		cpu_fetch_instruction(&machine->cpu_regs);
-		cpu_decode_instruction(machine);
-
-		if (machine->cpu_regs.vdc_request)
-			machine->cpu_regs.exception |=
-				vdc_add_instr(&machine->vdc_regs,
-					(uint32_t *)&machine->RAM[machine->cpu_regs.pc]);
+		cpu_run(machine, 1);
 
-		if (machine->cpu_regs.exception)
-			cpu_handle_exception(machine);
+		if (machine->cpu_regs.waiting) {
+			cpu_wait(machine);
+			continue;
+		}
 
 		nanosleep(&cpu_clk_freq, NULL);
 	}
 
 	pthread_exit(NULL);
 }
-
-
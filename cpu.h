@@ -25,6 +25,7 @@
 #include <stdint.h>
 
 #include "registers.h"
+#include "utils.h"
 #include "vdc.h"
 
 enum op_size {
@@ -42,21 +43,77 @@ enum conditions {
 	COND_UNDEF = 64,
 };
 
+#define CPU_WAIT_WFI	1	/* in wfi */
+#define CPU_WAIT_SPIN	2	/* in a loop that only a device can end */
+
+/* the last loop seen going round, see cpu_spin_check() */
+struct _cpu_spin {
+	unsigned long pc;		/* the branch back, 0 for none */
+	uint64_t icount;		/* when it was taken */
+	unsigned int events;		/* device events by then */
+	unsigned int len;		/* instructions per round */
+	uint16_t GP_REG[GP_REG_MAX + 1];
+	int cr;
+	uint16_t br;
+};
+
+/*
+ * The first cache lines are only written by the cpu thread. Fields other
+ * threads write (exceptions, reset, halt) live on a line of their own so
+ * they do not keep taking the registers away from the cpu. The debug
+ * history is written on every instruction, so it starts a new line too.
+ */
 struct _cpu_regs {
-	uint16_t GP_REG[GP_REG_MAX];	/* general purpose registers */
+	uint16_t GP_REG[GP_REG_MAX + 1];	/* general purpose registers */
 	unsigned long pc;		/* program counter */
+	uint64_t icount;		/* cycles: instructions, stalls and waits */
+	uint64_t retired;		/* instructions retired */
 	int sp;				/* stack pointer */
+	int stack_base;			/* the part of the stack of this core */
+	int stack_top;
 	int cr;				/* conditional register */
-	unsigned int exception;
-	unsigned int mclk;
+	uint16_t br;			/* bank register, upper bits of data addresses */
 	uint8_t vdc_request;
-	uint8_t reset;
+	uint8_t stalled;		/* runs again, see cpu_stall() */
 	uint8_t dbg;		/* enable debug mode */
+	uint8_t core;			/* number of this core, see smp.c */
+	int dbg_index;
+
+	/* state saved on interrupt entry, restored by reti */
+	uint8_t ie;			/* interrupts enabled */
+	uint8_t waiting;		/* CPU_WAIT_*, for a device event */
+	uint16_t ebr;
+	int ecr;
+	unsigned long epc;
+	uint64_t idle;			/* instruction times waited */
+	struct _cpu_spin spin;
+
+	unsigned int exception __cacheline_aligned;
+	uint8_t reset;
 	uint8_t panic;		/* halt cpu */
+	unsigned int mclk;
+
+	struct _dbg dbg_info[DBG_HISTORY] __cacheline_aligned;	/* written every instruction */
 };
 
 void cpu_reset(void *mach);
 
+void cpu_fault_setup(void);
+
+void cpu_init(void *mach);
+
+void cpu_event(void *mach);
+
+void cpu_kick(void *mach);
+
+void cpu_idle(void *mach, uint64_t periods);
+
+void cpu_stall(void *mach);
+
+void cpu_wait(void *mach);
+
+unsigned int cpu_run(void *mach, unsigned int instr_count);
+
 void *cpu_machine(void *mach);
 
 #endif /* __CPU_H__ */
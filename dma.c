@@ -0,0 +1,165 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * DMA engine.
+ *
+ * The guest fills in source, destination and length and writes the mode
+ * register with DMA_MODE_START. The engine then moves DMA_STEP_BYTES
+ * after every instruction the cpu retires, so the program keeps running
+ * while the data moves and a transfer takes the same number of
+ * instructions on every run, which keeps record, replay and rewind
+ * exact. The registers in RAM are the whole state of a transfer.
+ *
+ * The host side uses the same path for data from the outside, such as
+ * program loads.
+ */
+
+#include <stddef.h>
+
+#include "dma.h"
+#include "machine.h"
+#include "mmio.h"
+#include "ram.h"
+
+#define DMA_ADDR(lo, hi)	(((uint32_t)(hi) << 16) | (lo))
+
+static void dma_done(struct _machine *machine, uint16_t status)
+{
+	machine->dma->status = status;
+	ram_mark_dirty(machine, MEM_START_DMA, sizeof(struct _dma_regs));
+
+	if (status & (DMA_STATUS_DONE | DMA_STATUS_ERROR))
+		intc_raise(machine, IRQ_DMA);
+}
+
+/*
+ * One check covers the whole transfer: in RAM, not into the read only
+ * area or the registers and, for a copy, not overlapping itself.
+ */
+static int dma_valid(uint32_t src, uint32_t dst, uint32_t len, uint16_t mode)
+{
+	if ((dst < MEM_START_RW) || ((uint64_t)dst + len > RAM_SIZE))
+		return 0;
+
+	if ((dst < MEM_START_DMA + sizeof(struct _dma_regs)) && (dst + len > MEM_START_DMA))
+		return 0;
+
+	if (mode & DMA_MODE_FILL)
+		return 1;
+
+	if ((uint64_t)src + len > RAM_SIZE)
+		return 0;
+
+	return (src + len <= dst) || (dst + len <= src);
+}
+
+/* runs on the cpu after the guest wrote the mode register */
+static void dma_mode_written(struct _machine *machine, uint32_t addr,
+	uint32_t len, void *opaque)
+{
+	struct _dma_regs *dma = machine->dma;
+
+	if (!(dma->mode & DMA_MODE_START) || (dma->status & DMA_STATUS_BUSY))
+		return;
+
+	if (!dma_valid(DMA_ADDR(dma->src_lo, dma->src_hi), DMA_ADDR(dma->dst_lo, dma->dst_hi),
+	    DMA_ADDR(dma->len_lo, dma->len_hi), dma->mode)) {
+		dma_done(machine, DMA_STATUS_ERROR);
+		return;
+	}
+
+	dma_done(machine, DMA_STATUS_BUSY);
+}
+
+static const struct _mmio_region dma_mode_region = {
+	"dma", MEM_START_DMA + offsetof(struct _dma_regs, mode), sizeof(uint16_t),
+	NULL, dma_mode_written, NULL,
+};
+
+void dma_init(struct _machine *machine)
+{
+	mmio_register(machine, &dma_mode_region);
+}
+
+void dma_reset(struct _machine *machine)
+{
+	machine->dma = (struct _dma_regs *)(machine->RAM + MEM_START_DMA);
+	memset(machine->dma, 0x00, sizeof(struct _dma_regs));
+}
+
+/* called by the cpu while DMA_STATUS_BUSY is set */
+void dma_step(struct _machine *machine)
+{
+	struct _dma_regs *dma = machine->dma;
+	uint32_t src = DMA_ADDR(dma->src_lo, dma->src_hi);
+	uint32_t dst = DMA_ADDR(dma->dst_lo, dma->dst_hi);
+	uint32_t len = DMA_ADDR(dma->len_lo, dma->len_hi);
+	uint32_t chunk = (len > DMA_STEP_BYTES) ? DMA_STEP_BYTES : len;
+
+	/* the guest may have rewritten the registers under a running transfer */
+	if (!dma_valid(src, dst, len, dma->mode)) {
+		dma_done(machine, DMA_STATUS_ERROR);
+		return;
+	}
+
+	if (dma->mode & DMA_MODE_FILL) {
+		memset(machine->RAM + dst, dma->src_lo & 0xff, chunk);
+	} else {
+		mmio_range(machine, MMIO_READ, src, chunk);
+		memcpy(machine->RAM + dst, machine->RAM + src, chunk);
+		src += chunk;
+	}
+
+	ram_mark_dirty(machine, dst, chunk);
+	mmio_range(machine, MMIO_WRITE, dst, chunk);
+
+	dst += chunk;
+	len -= chunk;
+
+	dma->src_lo = src & 0xffff;
+	dma->src_hi = src >> 16;
+	dma->dst_lo = dst & 0xffff;
+	dma->dst_hi = dst >> 16;
+	dma->len_lo = len & 0xffff;
+	dma->len_hi = len >> 16;
+
+	dma_done(machine, len ? DMA_STATUS_BUSY : DMA_STATUS_DONE);
+}
+
+/*
+ * Data from the host, written at once. Loads are inputs from the replay
+ * log and have to land between two instructions, splitting them would
+ * leave host buffers behind in snapshots and checkpoints.
+ */
+int dma_host_write(struct _machine *machine, uint32_t addr, const void *data, uint32_t len)
+{
+	if ((uint64_t)addr + len > RAM_SIZE)
+		return -1;
+
+	memcpy(machine->RAM + addr, data, len);
+
+	ram_mark_dirty(machine, addr, len);
+	mmio_range(machine, MMIO_WRITE, addr, len);
+
+	return 0;
+}
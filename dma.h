@@ -0,0 +1,64 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __DMA_H_
+#define __DMA_H_
+
+#include <stdint.h>
+
+#define DMA_STEP_BYTES		64	/* moved per cpu instruction */
+
+/* mode, writing it with DMA_MODE_START starts a transfer */
+#define DMA_MODE_START		0x0001
+#define DMA_MODE_FILL		0x0002	/* low byte of src_lo, not a copy */
+
+#define DMA_STATUS_BUSY		0x0001
+#define DMA_STATUS_DONE		0x0002
+#define DMA_STATUS_ERROR	0x0004
+
+/*
+ * Guest registers at MEM_START_DMA. Addresses and length are split in
+ * 16 bit words, the engine counts them down while it runs so a snapshot
+ * taken mid transfer carries on from where it was.
+ */
+struct _dma_regs {
+	uint16_t src_lo;
+	uint16_t src_hi;
+	uint16_t dst_lo;
+	uint16_t dst_hi;
+	uint16_t len_lo;
+	uint16_t len_hi;
+	uint16_t mode;
+	uint16_t status;
+};
+
+struct _machine;
+
+void dma_init(struct _machine *machine);
+
+void dma_reset(struct _machine *machine);
+
+void dma_step(struct _machine *machine);
+
+int dma_host_write(struct _machine *machine, uint32_t addr, const void *data, uint32_t len);
+
+#endif /* __DMA_H_ */
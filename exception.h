@@ -33,6 +33,8 @@ typedef enum exceptions {
 	EXC_IOPORT		= (1 << 7),
 	EXC_SHUTDOWN	= (1 << 8),
 	EXC_VDC			= (1 << 9),
+	EXC_STACK		= (1 << 10),
+	EXC_DIV			= (1 << 11),
 } exception_t;
 
 #endif /*__EXCEPTION_H_  */
@@ -0,0 +1,272 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Host services.
+ *
+ * hcall n runs service n of the table below on the host, so a guest
+ * gets formatted output, searching, time and checksums without a loop
+ * of instructions for each, and without a new opcode for every need.
+ * A service works on guest registers and RAM only and counts as one
+ * instruction, so replay and rewind see the same results.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hcall.h"
+#include "opcodes.h"
+#include "machine.h"
+#include "exception.h"
+#include "mmio.h"
+#include "ram.h"
+#include "utils.h"
+#include "vdc.h"
+
+struct _hcall_service {
+	const char *name;
+	void (*run)(struct _machine *machine);
+};
+
+/* CRC-16/CCITT one nibble at a time */
+static const uint16_t hcall_crc_nibble[16] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+};
+
+/* a range of guest RAM, checked and made current for the host */
+static uint8_t *hcall_range(struct _machine *machine, uint16_t addr, uint32_t len)
+{
+	uint32_t start = MEM_BANK(machine->cpu_regs.br, addr);
+
+	if ((uint64_t)start + len > RAM_SIZE) {
+		machine->cpu_regs.exception |= EXC_MEM;
+		return NULL;
+	}
+
+	mmio_range(machine, MMIO_READ, start, len);
+
+	return machine->RAM + start;
+}
+
+/* a NUL terminated string of at most max chars, the length is in *len */
+static const char *hcall_string(struct _machine *machine, uint16_t addr, uint32_t max, uint32_t *len)
+{
+	uint32_t start = MEM_BANK(machine->cpu_regs.br, addr);
+	const char *s;
+
+	if (start >= RAM_SIZE) {
+		machine->cpu_regs.exception |= EXC_MEM;
+		return NULL;
+	}
+
+	if (max > RAM_SIZE - start)
+		max = RAM_SIZE - start;
+
+	s = (const char *)machine->RAM + start;
+	*len = strnlen(s, max);
+
+	mmio_range(machine, MMIO_READ, start, *len);
+
+	return s;
+}
+
+/*
+ * The text goes straight into the frame buffer at the vdc cursor, so
+ * the vdc has to be done with what the program asked of it before.
+ */
+static int hcall_vdc_busy(struct _machine *machine)
+{
+	struct _vdc_regs *vdc = &machine->vdc_regs;
+
+	if (vdc->instr_ptr)
+		return 1;
+
+	/* a vdc thread clears curr_instr to diwait once it is done with it */
+	return !vdc->sync && ((vdc->curr_instr & 0xff) != diwait);
+}
+
+static void hcall_console_write(struct _machine *machine, const char *text, int len)
+{
+	struct _vdc_regs *vdc = &machine->vdc_regs;
+	struct _cursor_data *cursor = &vdc->display.cursor_data;
+	uint16_t width = adapter_mode[vdc->display.mode].vertical;
+	uint16_t height = adapter_mode[vdc->display.mode].horizontal;
+	uint32_t addr;
+
+	/* disetxy takes any x, a cursor past the row goes on at the next one */
+	if (cursor->x >= width) {
+		cursor->x = 0;
+		cursor->y++;
+	}
+
+	for (int i = 0; (i < len) && (cursor->y < height); i++) {
+		if (text[i] != '\n') {
+			addr = cursor->y * width + cursor->x;
+			vdc->frame_buffer[addr] = text[i];
+			ram_mark_dirty(machine, MEM_START_VDC_FB + addr, 1);
+		}
+
+		if ((text[i] == '\n') || (++cursor->x >= width)) {
+			cursor->x = 0;
+			cursor->y++;
+		}
+	}
+}
+
+/* %d %u %x %c %s and %%, the arguments are r2..r5 in turn */
+static void hcall_print(struct _machine *machine)
+{
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+	char out[HCALL_PRINT_MAX + 1];
+	const char *fmt, *s;
+	uint32_t fmt_len, s_len;
+	int arg = 2;
+	int len = 0;
+	uint16_t val;
+
+	if (hcall_vdc_busy(machine)) {
+		cpu_stall(machine);
+		return;
+	}
+
+	fmt = hcall_string(machine, cpu_regs->GP_REG[1], HCALL_PRINT_MAX, &fmt_len);
+	if (!fmt)
+		return;
+
+	for (int i = 0; (i < fmt_len) && (len < HCALL_PRINT_MAX); i++) {
+		if ((fmt[i] != '%') || (i + 1 == fmt_len)) {
+			out[len++] = fmt[i];
+			continue;
+		}
+
+		i++;
+		if (fmt[i] == '%') {
+			out[len++] = '%';
+			continue;
+		}
+
+		val = (arg <= 5) ? cpu_regs->GP_REG[arg++] : 0;
+
+		switch (fmt[i]) {
+		case 'd':
+			len += snprintf(out + len, sizeof(out) - len, "%d", (int16_t)val);
+			break;
+		case 'u':
+			len += snprintf(out + len, sizeof(out) - len, "%u", val);
+			break;
+		case 'x':
+			len += snprintf(out + len, sizeof(out) - len, "%x", val);
+			break;
+		case 'c':
+			out[len++] = val & 0xff;
+			break;
+		case 's':
+			s = hcall_string(machine, val, HCALL_PRINT_MAX - len, &s_len);
+			if (!s)
+				return;
+			memcpy(out + len, s, s_len);
+			len += s_len;
+			break;
+		default:
+			out[len++] = '%';
+			out[len++] = fmt[i];
+			break;
+		}
+
+		if (len > HCALL_PRINT_MAX)
+			len = HCALL_PRINT_MAX;
+	}
+
+	/* text modes only, like dichar */
+	if ((machine->vdc_regs.display.mode == mode_40x12) ||
+	    (machine->vdc_regs.display.mode == mode_80x25))
+		hcall_console_write(machine, out, len);
+
+	cpu_regs->GP_REG[0] = len;
+}
+
+static void hcall_find(struct _machine *machine)
+{
+	uint16_t *reg = machine->cpu_regs.GP_REG;
+	uint8_t *p, *hit;
+
+	p = hcall_range(machine, reg[1], reg[3]);
+	if (!p)
+		return;
+
+	hit = memchr(p, reg[2] & 0xff, reg[3]);
+
+	reg[0] = hit ? (hit - p) : HCALL_NONE;
+}
+
+/* guest time: retired and idle cycles at the master clock */
+static void hcall_time(struct _machine *machine)
+{
+	struct _cpu_regs *cpu_regs = &machine->cpu_regs;
+	uint64_t ms = cpu_regs->icount * 1000 / cpu_regs->mclk;
+
+	cpu_regs->GP_REG[0] = ms & 0xffff;
+	cpu_regs->GP_REG[1] = (ms >> 16) & 0xffff;
+	cpu_regs->GP_REG[2] = cpu_regs->mclk;
+}
+
+static void hcall_crc(struct _machine *machine)
+{
+	uint16_t *reg = machine->cpu_regs.GP_REG;
+	uint16_t crc = reg[3];
+	uint8_t *p;
+
+	p = hcall_range(machine, reg[1], reg[2]);
+	if (!p)
+		return;
+
+	for (uint32_t i = 0; i < reg[2]; i++) {
+		crc = (crc << 4) ^ hcall_crc_nibble[(crc >> 12) ^ (p[i] >> 4)];
+		crc = (crc << 4) ^ hcall_crc_nibble[(crc >> 12) ^ (p[i] & 0x0f)];
+	}
+
+	reg[0] = crc;
+}
+
+/* indexed by service number */
+static const struct _hcall_service hcall_services[] = {
+	[HCALL_PRINT] = { "print", hcall_print },
+	[HCALL_FIND] = { "find", hcall_find },
+	[HCALL_TIME] = { "time", hcall_time },
+	[HCALL_CRC] = { "crc", hcall_crc },
+};
+
+void hcall_dispatch(struct _machine *machine, uint8_t service)
+{
+	if (service >= sizeof(hcall_services) / sizeof(hcall_services[0])) {
+		machine->cpu_regs.exception |= EXC_INSTR;
+		return;
+	}
+
+	debug_opcode(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index,
+		hcall_services[service].name);
+	debug_args(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index,
+		machine->cpu_regs.GP_REG + 1, machine->cpu_regs.GP_REG + 2);
+
+	hcall_services[service].run(machine);
+}
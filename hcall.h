@@ -0,0 +1,46 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __HCALL_H_
+#define __HCALL_H_
+
+#include <stdint.h>
+
+/*
+ * Host services for the hcall instruction. Arguments are taken from
+ * r1 upwards, the result is left in r0. Addresses are in the bank
+ * selected by br.
+ */
+#define HCALL_PRINT		0	/* r1 format, r2..r5 arguments: r0 = chars written */
+#define HCALL_FIND		1	/* r1 address, r2 byte, r3 length: r0 = offset or HCALL_NONE */
+#define HCALL_TIME		2	/* r0, r1 = ms since reset, low word first, r2 = mclk */
+#define HCALL_CRC		3	/* r1 address, r2 length, r3 start value: r0 = crc */
+
+#define HCALL_NONE		0xffff
+#define HCALL_PRINT_MAX		256	/* chars of output per call */
+#define HCALL_CRC_START		0xffff	/* CRC-16/CCITT */
+
+struct _machine;
+
+void hcall_dispatch(struct _machine *machine, uint8_t service);
+
+#endif /* __HCALL_H_ */
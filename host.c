@@ -0,0 +1,344 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host runtime: many machines on a fixed pool of worker threads.
+ *
+ * Every worker owns a run queue. A worker takes the machine at the front
+ * of its own queue, runs it for one time slice and puts it back at the
+ * end, behind the others. A worker with an empty queue steals the front
+ * machine of another worker. Halted machines are retired, and so are
+ * machines that wait with nothing left to wake them: there are no device
+ * threads in the pool, only the timer ends a wait.
+ */
+
+#include "host.h"
+#include "exception.h"
+#include "ram.h"
+
+#define HOST_IDLE_TIMEOUT_MS	100
+
+/* calloc() for arrays of cache line aligned elements */
+static void *host_calloc(size_t count, size_t size)
+{
+	void *p;
+
+	if (posix_memalign(&p, CACHE_LINE_SIZE, count * size))
+		return NULL;
+
+	return memset(p, 0x00, count * size);
+}
+
+/* one slot more than machines, a full ring is then never taken for empty */
+static int host_queue_init(struct _host_queue *queue, unsigned int size)
+{
+	size++;
+
+	queue->slot = calloc(size, sizeof(struct _host_instance *));
+	if (!queue->slot)
+		return 0;
+
+	queue->head = queue->tail = 0;
+	queue->size = size;
+	pthread_mutex_init(&queue->lock, NULL);
+
+	return 1;
+}
+
+static void host_queue_push(struct _host_queue *queue, struct _host_instance *inst)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->slot[queue->tail] = inst;
+	queue->tail = (queue->tail + 1) % queue->size;
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/* the owner and thieves both take the oldest, so a yielded machine waits its turn */
+static struct _host_instance *host_queue_pop(struct _host_queue *queue)
+{
+	struct _host_instance *inst = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->tail != queue->head) {
+		inst = queue->slot[queue->head];
+		queue->head = (queue->head + 1) % queue->size;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return inst;
+}
+
+static void host_enqueue(struct _host *host, struct _host_worker *worker,
+	struct _host_instance *inst)
+{
+	inst->state = HOST_RUNNABLE;
+
+	host_queue_push(&worker->queue, inst);
+	__atomic_add_fetch(&host->queued, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&host->sleepers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&host->lock);
+		pthread_cond_signal(&host->wakeup);
+		pthread_mutex_unlock(&host->lock);
+	}
+}
+
+static struct _host_instance *host_next(struct _host_worker *worker)
+{
+	struct _host *host = worker->host;
+	struct _host_instance *inst;
+	unsigned int victim;
+
+	inst = host_queue_pop(&worker->queue);
+
+	if (!inst && __atomic_load_n(&host->queued, __ATOMIC_SEQ_CST)) {
+		victim = rand_r(&worker->seed) % host->workers;
+
+		for (int w = 0; (w < host->workers) && !inst; w++) {
+			struct _host_worker *other = host->worker + ((victim + w) % host->workers);
+
+			if (other == worker)
+				continue;
+
+			inst = host_queue_pop(&other->queue);
+			if (inst)
+				worker->steals++;
+		}
+	}
+
+	if (inst)
+		__atomic_sub_fetch(&host->queued, 1, __ATOMIC_SEQ_CST);
+
+	return inst;
+}
+
+static void host_retire(struct _host *host, struct _host_instance *inst)
+{
+	pthread_mutex_lock(&host->lock);
+
+	inst->state = HOST_RETIRED;
+	host->retired++;
+
+	if (host->retired == host->instances) {
+		__atomic_store_n(&host->done, 1, __ATOMIC_SEQ_CST);
+		pthread_cond_broadcast(&host->wakeup);
+	}
+
+	pthread_mutex_unlock(&host->lock);
+}
+
+static void host_idle(struct _host *host)
+{
+	struct timespec timeout;
+
+	clock_gettime(CLOCK_REALTIME, &timeout);
+	timeout.tv_nsec += HOST_IDLE_TIMEOUT_MS * 1000000L;
+	if (timeout.tv_nsec >= 1000000000L) {
+		timeout.tv_sec++;
+		timeout.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&host->lock);
+
+	__atomic_add_fetch(&host->sleepers, 1, __ATOMIC_SEQ_CST);
+
+	while (!host->done && !__atomic_load_n(&host->queued, __ATOMIC_SEQ_CST)) {
+		if (pthread_cond_timedwait(&host->wakeup, &host->lock, &timeout))
+			break;
+	}
+
+	__atomic_sub_fetch(&host->sleepers, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&host->lock);
+}
+
+static void *host_worker(void *arg)
+{
+	struct _host_worker *worker = arg;
+	struct _host *host = worker->host;
+	struct _host_instance *inst;
+	unsigned int executed;
+
+	while (!__atomic_load_n(&host->done, __ATOMIC_SEQ_CST)) {
+		inst = host_next(worker);
+		if (!inst) {
+			host_idle(host);
+			continue;
+		}
+
+		executed = cpu_run(inst->machine, host->slice);
+
+		inst->instructions += executed;
+		worker->instructions += executed;
+
+		/* no clock to wait for, go straight to the timer */
+		if (inst->machine->cpu_regs.waiting)
+			cpu_idle(inst->machine, UINT64_MAX);
+
+		if (inst->machine->cpu_regs.panic) {
+			host_retire(host, inst);
+		} else if (inst->machine->cpu_regs.reset ||
+			   (inst->machine->cpu_regs.waiting && (inst->machine->timer->due == TIMER_OFF))) {
+			fprintf(stderr, "%s: machine %u waits for a device, retired\n",
+				__func__, inst->id);
+			inst->machine->cpu_regs.panic = 1;
+			host_retire(host, inst);
+		} else {
+			host_enqueue(host, worker, inst);
+		}
+	}
+
+	pthread_exit(NULL);
+}
+
+struct _host *host_create(unsigned int instances, unsigned int workers,
+	unsigned int slice, host_setup_t setup)
+{
+	struct _host *host;
+
+	if (!instances || !workers)
+		return NULL;
+
+	host = calloc(1, sizeof(struct _host));
+	if (!host)
+		return NULL;
+
+	host->instances = instances;
+	host->workers = workers;
+	host->slice = slice ? slice : HOST_SLICE_DEFAULT;
+
+	pthread_mutex_init(&host->lock, NULL);
+	pthread_cond_init(&host->wakeup, NULL);
+
+	host->inst = host_calloc(instances, sizeof(struct _host_instance));
+	host->worker = host_calloc(workers, sizeof(struct _host_worker));
+	if (!host->inst || !host->worker)
+		goto host_create_fail;
+
+	for (int w = 0; w < workers; w++) {
+		host->worker[w].host = host;
+		host->worker[w].id = w;
+		host->worker[w].seed = w + 1;
+		if (!host_queue_init(&host->worker[w].queue, instances))
+			goto host_create_fail;
+	}
+
+	for (int i = 0; i < instances; i++) {
+		struct _host_instance *inst = host->inst + i;
+
+		inst->id = i;
+		inst->machine = machine_alloc();
+		if (!inst->machine)
+			goto host_create_fail;
+
+		/* small pages, so machines share what they have not written */
+		inst->machine->RAM = ram_alloc(0);
+		if (!inst->machine->RAM)
+			goto host_create_fail;
+
+		if (setup(inst->machine, i))
+			goto host_create_fail;
+
+		/* no device threads: the vdc runs on the worker, nothing is drawn */
+		inst->machine->vdc_regs.sync = 1;
+		inst->machine->vdc_regs.display.headless = 1;
+
+		inst->machine->cpu_regs.reset = 0;
+		inst->machine->vdc_regs.reset = 0;
+
+		host_enqueue(host, host->worker + (i % workers), inst);
+	}
+
+	return host;
+
+host_create_fail:
+	host_destroy(host);
+	return NULL;
+}
+
+void host_run(struct _host *host)
+{
+	struct timespec start, stop;
+	uint64_t instructions = 0;
+	unsigned int steals = 0;
+	unsigned long pages = 0;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int w = 0; w < host->workers; w++)
+		pthread_create(&host->worker[w].thread, NULL, host_worker, host->worker + w);
+
+	for (int w = 0; w < host->workers; w++) {
+		pthread_join(host->worker[w].thread, NULL);
+		instructions += host->worker[w].instructions;
+		steals += host->worker[w].steals;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("\n%s: %u machines, %u workers, %llu instructions in %.3f s (%.1f MIPS), %u steals\n",
+		__func__, host->instances, host->workers, (unsigned long long)instructions,
+		elapsed, elapsed > 0 ? instructions / elapsed / 1e6 : 0.0, steals);
+
+	for (int i = 0; i < host->instances; i++)
+		pages += ram_private_pages(host->inst[i].machine->RAM);
+
+	printf("%s: %lu KB private RAM per machine\n", __func__,
+		pages * sysconf(_SC_PAGESIZE) / 1024 / host->instances);
+}
+
+/*
+ * May be called from a signal handler, so only flags are touched. Running
+ * machines trap on the exception.
+ */
+void host_shutdown(struct _host *host)
+{
+	for (int i = 0; i < host->instances; i++) {
+		if (host->inst[i].machine)
+			host->inst[i].machine->cpu_regs.exception |= EXC_SHUTDOWN;
+	}
+}
+
+void host_destroy(struct _host *host)
+{
+	if (!host)
+		return;
+
+	if (host->inst) {
+		for (int i = 0; i < host->instances; i++) {
+			if (host->inst[i].machine)
+				ram_free(host->inst[i].machine->RAM);
+			free(host->inst[i].machine);
+		}
+		free(host->inst);
+	}
+
+	if (host->worker) {
+		for (int w = 0; w < host->workers; w++)
+			free(host->worker[w].queue.slot);
+		free(host->worker);
+	}
+
+	free(host);
+}
@@ -0,0 +1,93 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HOST_H_
+#define __HOST_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "machine.h"
+
+#define HOST_SLICE_DEFAULT	10000	/* instructions per time slice */
+
+enum host_state {
+	HOST_RUNNABLE,
+	HOST_RETIRED,
+};
+
+/* instances and workers are written by different workers, one line each */
+struct _host_instance {
+	struct _machine *machine;
+	unsigned int id;
+	enum host_state state;
+	uint64_t instructions;
+} __cacheline_aligned;
+
+/*
+ * Run queue of a worker, first in first out. Machines are pushed at the
+ * tail, the owner and workers stealing from it pop at the head.
+ */
+struct _host_queue {
+	pthread_mutex_t lock;
+	struct _host_instance **slot;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int size;
+};
+
+struct _host_worker {
+	struct _host *host;
+	unsigned int id;
+	pthread_t thread;
+	struct _host_queue queue;
+	unsigned int seed;
+	unsigned int steals;
+	uint64_t instructions;
+} __cacheline_aligned;
+
+struct _host {
+	struct _host_instance *inst;
+	unsigned int instances;
+	struct _host_worker *worker;
+	unsigned int workers;
+	unsigned int slice;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	int queued;		/* instances waiting in any run queue */
+	int sleepers;		/* workers waiting for work */
+	unsigned int retired;
+	int done;
+};
+
+/* returns 0 when the machine is ready to run */
+typedef int (*host_setup_t)(struct _machine *machine, unsigned int id);
+
+struct _host *host_create(unsigned int instances, unsigned int workers,
+	unsigned int slice, host_setup_t setup);
+
+void host_run(struct _host *host);
+
+void host_shutdown(struct _host *host);
+
+void host_destroy(struct _host *host);
+
+#endif /* __HOST_H_ */
@@ -0,0 +1,135 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Interrupt controller and timer registers. The cpu takes the interrupts,
+ * see cpu_interrupt(). Like all device registers they live in RAM, so a
+ * snapshot or checkpoint carries pending lines and a running timer.
+ */
+
+#include <stddef.h>
+
+#include "intc.h"
+#include "machine.h"
+#include "mmio.h"
+#include "ram.h"
+
+/* may be called from any device thread */
+void intc_raise(struct _machine *machine, unsigned int line)
+{
+	__atomic_or_fetch(&machine->intc->pending, 1 << line, __ATOMIC_SEQ_CST);
+	ram_mark_dirty(machine, MEM_INTC_CORE(machine->cpu_regs.core), sizeof(uint16_t));
+
+	cpu_event(machine);
+}
+
+static void intc_ack_written(struct _machine *machine, uint32_t addr,
+	uint32_t len, void *opaque)
+{
+	struct _intc_regs *intc = machine->intc;
+
+	__atomic_and_fetch(&intc->pending, ~intc->ack, __ATOMIC_SEQ_CST);
+	intc->ack = 0;
+}
+
+static const struct _mmio_region intc_ack_region = {
+	"intc", MEM_START_INTC + offsetof(struct _intc_regs, ack), sizeof(uint16_t),
+	NULL, intc_ack_written, NULL,
+};
+
+static __inline__ uint64_t timer_interval(struct _timer_regs *timer)
+{
+	return (uint64_t)timer->period << (timer->prescale & 0x1f);
+}
+
+static void timer_read(struct _machine *machine, uint32_t addr,
+	uint32_t len, void *opaque)
+{
+	struct _timer_regs *timer = machine->timer;
+	uint64_t left = 0;
+
+	if (timer->due != TIMER_OFF)
+		left = (timer->due - machine->cpu_regs.icount) >> (timer->prescale & 0x1f);
+
+	timer->count = (left > 0xffff) ? 0xffff : left;
+}
+
+static void timer_written(struct _machine *machine, uint32_t addr,
+	uint32_t len, void *opaque)
+{
+	struct _timer_regs *timer = machine->timer;
+
+	if ((timer->ctrl & TIMER_ENABLE) && timer->period)
+		timer->due = machine->cpu_regs.icount + timer_interval(timer);
+	else
+		timer->due = TIMER_OFF;
+}
+
+static const struct _mmio_region timer_region = {
+	"timer", MEM_START_TIMER, offsetof(struct _timer_regs, due),
+	timer_read, timer_written, NULL,
+};
+
+/* called by the cpu once the instruction count reached due */
+void timer_expire(struct _machine *machine)
+{
+	struct _timer_regs *timer = machine->timer;
+
+	if ((timer->ctrl & TIMER_ENABLE) && timer->period) {
+		intc_raise(machine, IRQ_TIMER);
+
+		if (timer->ctrl & TIMER_PERIODIC) {
+			timer->due += timer_interval(timer);
+			if (timer->due <= machine->cpu_regs.icount)
+				timer->due = machine->cpu_regs.icount + timer_interval(timer);
+		} else {
+			timer->ctrl &= ~TIMER_ENABLE;
+			timer->due = TIMER_OFF;
+		}
+	} else {
+		timer->due = TIMER_OFF;
+	}
+
+	ram_mark_dirty(machine, MEM_TIMER_CORE(machine->cpu_regs.core), sizeof(struct _timer_regs));
+}
+
+/* cores other than the first have their registers further up the page */
+void intc_init(struct _machine *machine)
+{
+	struct _mmio_region ack = intc_ack_region;
+	struct _mmio_region timer = timer_region;
+
+	ack.start += MEM_INTC_CORE(machine->cpu_regs.core) - MEM_START_INTC;
+	timer.start += MEM_TIMER_CORE(machine->cpu_regs.core) - MEM_START_TIMER;
+
+	mmio_register(machine, &ack);
+	mmio_register(machine, &timer);
+}
+
+void intc_reset(struct _machine *machine)
+{
+	memset(machine->intc, 0x00, sizeof(struct _intc_regs));
+	machine->intc->active = IRQ_NONE;
+
+	memset(machine->timer, 0x00, sizeof(struct _timer_regs));
+	machine->timer->due = TIMER_OFF;
+}
@@ -0,0 +1,82 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __INTC_H_
+#define __INTC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* interrupt lines, a lower line is served first */
+#define IRQ_TIMER		0
+#define IRQ_IO_INPUT		1	/* the input port changed */
+#define IRQ_VDC_RETRACE		2	/* a frame was put on the display */
+#define IRQ_PRG_LOAD		3	/* a program load completed */
+#define IRQ_DMA			4	/* a dma transfer completed or was refused */
+#define IRQ_CORE		5	/* another core asked for attention, see cstart */
+#define IRQ_LINES		16
+#define IRQ_NONE		0xffff
+
+/*
+ * Controller registers at MEM_INTC_CORE(). Devices set bits in pending,
+ * the guest clears them by writing them to ack. A line interrupts the cpu
+ * when it is pending, set in mask and interrupts are enabled (ei).
+ */
+struct _intc_regs {
+	uint16_t pending;
+	uint16_t mask;
+	uint16_t ack;
+	uint16_t active;		/* line being served */
+	uint16_t vector[IRQ_LINES];	/* handler address of each line */
+};
+
+#define TIMER_ENABLE		0x0001
+#define TIMER_PERIODIC		0x0002
+#define TIMER_OFF		UINT64_MAX
+
+/*
+ * Timer registers at MEM_TIMER_CORE(). The timer counts retired
+ * instructions and expires every period << prescale of them. Writing any
+ * register restarts it, count reads the instructions left before the
+ * next expiry, shifted by prescale.
+ */
+struct _timer_regs {
+	uint16_t ctrl;
+	uint16_t period;
+	uint16_t prescale;
+	uint16_t count;
+	uint64_t due;		/* instruction count of the next expiry */
+};
+
+#define TIMER_REG(reg)		(MEM_START_TIMER + offsetof(struct _timer_regs, reg))
+
+struct _machine;
+
+void intc_init(struct _machine *machine);
+
+void intc_reset(struct _machine *machine);
+
+void intc_raise(struct _machine *machine, unsigned int line);
+
+void timer_expire(struct _machine *machine);
+
+#endif /* __INTC_H_ */
@@ -23,21 +23,92 @@
 #include "exception.h"
 #include "machine.h"
 #include "utils.h"
+#include "replay.h"
+#include "mmio.h"
+
+#define IOPORT_WAIT_MS	100	/* how often a waiting port looks for a halt */
+
+static void ioport_set_input(struct _machine *machine, uint16_t input)
+{
+	replay_post(machine, REPLAY_IO_INPUT, &input, sizeof(input));
+}
+
+/* runs on the cpu, the output side sends the new value */
+static void ioport_output_written(struct _machine *machine, uint32_t addr,
+	uint32_t len, void *opaque)
+{
+	pthread_mutex_lock(&machine->io.lock);
+	machine->io.pending = 1;
+	pthread_cond_signal(&machine->io.written);
+	pthread_mutex_unlock(&machine->io.lock);
+}
+
+static const struct _mmio_region ioport_output_region = {
+	"io_output", MEM_IO_OUTPUT, sizeof(uint16_t), NULL, ioport_output_written, NULL,
+};
+
+/*
+ * Wait for the guest to write the output port. The first call returns at
+ * once so a reader gets the current value. Returns non zero when the
+ * machine halted, the value is then sent one last time.
+ */
+static int ioport_output_wait(struct _machine *machine, uint16_t *output)
+{
+	struct timespec timeout;
+
+	pthread_mutex_lock(&machine->io.lock);
+
+	while (!machine->io.pending && !machine->cpu_regs.panic) {
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_nsec += IOPORT_WAIT_MS * 1000000L;
+		if (timeout.tv_nsec >= 1000000000L) {
+			timeout.tv_sec++;
+			timeout.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait(&machine->io.written, &machine->io.lock, &timeout);
+	}
+
+	machine->io.pending = 0;
+	*output = machine->ioport->output;
+
+	pthread_mutex_unlock(&machine->io.lock);
+
+	return machine->cpu_regs.panic;
+}
+
+/* host side of the port, every machine has one whatever its RAM holds */
+void ioport_init(void *mach)
+{
+	struct _machine *machine = mach;
+
+	pthread_mutex_init(&machine->io.lock, NULL);
+	pthread_cond_init(&machine->io.written, NULL);
+	machine->io.pending = 1;
+
+	mmio_register(machine, &ioport_output_region);
+}
 
 void ioport_reset(void *mach)
 {
 	struct _machine *machine = mach;
 
-	machine->ioport = (struct _io_regs *)&machine->RAM[MEM_START_IOPORT];
+	machine->ioport = (struct _io_regs *)(machine->RAM + MEM_START_IOPORT);
 	memset(machine->ioport, 0x00, sizeof(struct _io_regs));
 }
 
-void ioport_shutdown(int input_state)
+void ioport_shutdown(void *mach)
 {
+	struct _machine *machine = mach;
 	char *in_port;
 	int fd;
 	int t;
 
+	/* the output side sends once more when it sees the halt */
+	pthread_mutex_lock(&machine->io.lock);
+	pthread_cond_broadcast(&machine->io.written);
+	pthread_mutex_unlock(&machine->io.lock);
+
 	fd = open(DEV_IO_OUTPUT, O_RDONLY);
 	t = read(fd, NULL, 4); /* t silence compiler warning */
 
@@ -48,7 +119,7 @@ void ioport_shutdown(int input_state)
 		perror("something fuzzy going on in read@ioport_shutdown");
 	}
 
-	in_port = int_to_str(input_state);
+	in_port = int_to_str((int)machine->ioport->input);
 
 	fd = open(DEV_IO_INPUT, O_WRONLY);
 	t = write(fd, in_port, strlen(in_port));
@@ -62,18 +133,15 @@ void ioport_shutdown(int input_state)
 	free(in_port);
 }
 
+/* sends the output port whenever the guest writes it */
 void *ioport_machine_output(void *mach)
 {
 	struct _machine *machine = mach;
-	struct timespec io_clk_freq;
-	io_clk_freq.tv_sec = 0;
+	uint16_t output;
+	int halted;
 
-	while(!machine->cpu_regs.panic) {
-		io_clk_freq.tv_nsec = 1000000000 / (machine->cpu_regs.mclk * 4);
-
-		while(machine->cpu_regs.reset) {
-			nanosleep(&io_clk_freq, NULL);
-		}
+	do {
+		halted = ioport_output_wait(machine, &output);
 
 		int fd = open(DEV_IO_OUTPUT, O_WRONLY);
 		if (fd < 0) {
@@ -81,7 +149,7 @@ void *ioport_machine_output(void *mach)
 			machine->cpu_regs.exception = EXC_IOPORT;
 			pthread_exit(NULL);
 		}
-		char *outval = int_to_str((int)machine->ioport->output);
+		char *outval = int_to_str((int)output);
 
 		if (write(fd, outval, strlen(outval)) == -1) {
 			if (errno == EPIPE)
@@ -90,9 +158,7 @@ void *ioport_machine_output(void *mach)
 		close(fd);
 
 		free(outval);
-
-		nanosleep(&io_clk_freq, NULL);
-	}
+	} while (!halted);
 
 	pthread_exit(NULL);
 }
@@ -126,8 +192,71 @@ void *ioport_machine_input(void *mach)
 			continue;
 		}
 
-		machine->ioport->input = atoi(inval);
+		ioport_set_input(machine, atoi(inval));
 	}
 
 	pthread_exit(NULL);
 }
+
+/*
+ * Non blocking variants of the port threads, for machines where all
+ * devices are polled from one thread. The input fifo is kept open
+ * between polls in *fd. The output is sent once someone reads it.
+ */
+void ioport_poll_output(void *mach)
+{
+	struct _machine *machine = mach;
+	char *outval;
+
+	/* same thread as the cpu, nothing to send until it wrote the port */
+	if (!machine->io.pending)
+		return;
+
+	int fd = open(DEV_IO_OUTPUT, O_WRONLY | O_NONBLOCK);
+	if (fd < 0) {
+		if (errno != ENXIO) {
+			perror("unable to access output port");
+			machine->cpu_regs.exception = EXC_IOPORT;
+		}
+		return;
+	}
+
+	machine->io.pending = 0;
+
+	outval = int_to_str((int)machine->ioport->output);
+
+	if (write(fd, outval, strlen(outval)) == -1) {
+		if (errno == EPIPE)
+			perror("read side closed pipe");
+	}
+	close(fd);
+
+	free(outval);
+}
+
+void ioport_poll_input(void *mach, int *fd)
+{
+	struct _machine *machine = mach;
+	char inval[16] = { 0 };
+
+	if (*fd < 0) {
+		*fd = open(DEV_IO_INPUT, O_RDONLY | O_NONBLOCK);
+		if (*fd < 0) {
+			perror("unable to access input port");
+			machine->cpu_regs.exception = EXC_IOPORT;
+			return;
+		}
+	}
+
+	/* the whole line, a trailing newline must not be read as a new value */
+	int t = read(*fd, inval, sizeof(inval) - 1);
+
+	if (t == -1) {
+		if (errno != EAGAIN)
+			perror("error reading I/O");
+		return;
+	}
+
+	if (t > 0)
+		ioport_set_input(machine, atoi(inval));
+}
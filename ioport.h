@@ -23,6 +23,7 @@
 #define __IOPORT_H__
 
 #include <stdint.h>
+#include <pthread.h>
 
 #define DEV_IO_INPUT	"machine/io_input"
 #define DEV_IO_OUTPUT	"machine/io_output"
@@ -32,15 +33,26 @@ struct _io_regs {
 	uint16_t output;
 };
 
+/* host side of the port, the guest sees only _io_regs */
+struct _io_dev {
+	pthread_mutex_t lock;
+	pthread_cond_t written;
+	int pending;		/* output written and not yet sent */
+};
 
+void ioport_init(void *mach);
 
 void ioport_reset(void *mach);
 
-void ioport_shutdown(int input_state);
+void ioport_shutdown(void *mach);
 
 void *ioport_machine_output(void *mach);
 
 void *ioport_machine_input(void *mach);
 
+void ioport_poll_output(void *mach);
+
+void ioport_poll_input(void *mach, int *fd);
+
 
 #endif /* __IOPORT_H__ */
\ No newline at end of file
@@ -31,32 +31,118 @@
 #include <time.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "cpu.h"
 #include "vdc.h"
 #include "ioport.h"
+#include "dma.h"
+#include "intc.h"
+#include "counter.h"
 #include "memory.h"
 
 #define MACHINE_RESET_VECTOR	(MEM_START_ROM - sizeof(uint32_t))
 #define MACHINE_DEVICE_LIST_END	'\0'
 #define MACHINE_MASTER_CLOCK	1400	/* Master oscillator runs @ 1.4 MHz */
 
+struct _machine;
+struct _replay;
+struct _snapshot_ctl;
+struct _rewind;
+struct _smp;
+
+/* every consumer of dirty pages has its own bitmap */
+enum ram_dirty_channel {
+	RAM_DIRTY_SNAPSHOT,
+	RAM_DIRTY_REWIND,
+	RAM_DIRTY_DISPLAY,
+	RAM_DIRTY_CHANNELS,
+};
+
+#define MMIO_REGIONS_MAX	16
+
+/* page flags of the mmio table, the low bits are the region + 1 */
+#define MMIO_READ	0x80
+#define MMIO_WRITE	0x40
+#define MMIO_REGION	0x3f
+
+typedef void (*mmio_handler_t)(struct _machine *machine, uint32_t addr,
+	uint32_t len, void *opaque);
+
+struct _mmio_region {
+	const char *name;
+	uint32_t start;
+	uint32_t size;
+	mmio_handler_t read;	/* before the guest reads, may be NULL */
+	mmio_handler_t write;	/* after the guest wrote, may be NULL */
+	void *opaque;
+};
+
+struct _mmio {
+	uint8_t page[RAM_PAGES];
+	struct _mmio_region region[MMIO_REGIONS_MAX];
+	int regions;
+};
+
+/* a cpu in wfi or in a polling loop sleeps here, see cpu_event() */
+struct _cpu_wait {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int events;	/* device events so far */
+	unsigned int seen;	/* events when the wait started */
+	int kick;		/* new input to look at */
+};
+
 struct _machine_reg {
 		uint8_t *prg_loading;
 		uint8_t *boot_msg;
 		uint8_t *boot_anim;
 };
 
+/*
+ * Hot interpreter state first, then what the cpu reads on every
+ * instruction, then device state on cache lines of its own. Allocate
+ * with machine_alloc() to keep the alignment.
+ */
 struct _machine {
-	uint8_t RAM[RAM_SIZE];
 	struct _cpu_regs cpu_regs;
-	struct _machine_reg mach_regs;
-	struct _vdc_regs vdc_regs;
+	uint8_t *RAM;			/* RAM_SIZE bytes, see ram.c */
+	struct _dma_regs *dma;		/* in RAM, see dma.c */
+	struct _intc_regs *intc;	/* in RAM, see intc.c */
+	struct _timer_regs *timer;
+	struct _counter_regs *counter;	/* in RAM, see counter.c */
+	struct _replay *replay;		/* input log, NULL when not recording */
+	struct _snapshot_ctl *snapshot;	/* NULL disables snapshots */
+	struct _rewind *rewind;		/* NULL without reverse execution */
+	struct _smp *smp;		/* the other cores, NULL with only one */
+	int watch;			/* report writes to watch_addr */
+	uint32_t watch_addr;
+	int64_t watch_hit;		/* instruction that last wrote it */
+	struct _mmio mmio;		/* device pages, see mmio.c */
+
+	uint64_t dirty[RAM_DIRTY_CHANNELS][RAM_PAGES / 64] __cacheline_aligned;
+
+	struct _vdc_regs vdc_regs __cacheline_aligned;
 	struct _display_adapter display;
+	struct _machine_reg mach_regs;
 	struct _io_regs *ioport;
+	struct _io_dev io;
+	struct _cpu_wait wait;
+	int signals;			/* host signals to take, see replay_signal() */
+	struct _counter_host counters;
 	exception_t exception;
 };
 
+static __inline__ struct _machine *machine_alloc(void)
+{
+	void *machine;
+
+	if (posix_memalign(&machine, CACHE_LINE_SIZE, sizeof(struct _machine)))
+		return NULL;
+
+	return memset(machine, 0x00, sizeof(struct _machine));
+}
+
 #endif /* __MACHINE_H_ */
\ No newline at end of file
@@ -27,6 +27,13 @@
 #include "rom.h"
 #include "utils.h"
 #include "vdc.h"
+#include "host.h"
+#include "scheduler.h"
+#include "replay.h"
+#include "snapshot.h"
+#include "ram.h"
+#include "rewind.h"
+#include "smp.h"
 #include "machine.h"
 
 typedef struct {
@@ -35,9 +42,29 @@ typedef struct {
 	char *load_program;
 	int dump_ram;
 	int dump_size;
+	int instances;
+	int workers;
+	int slice;
+	int coop;
+	char *record;
+	char *replay;
+	char *snapshot;
+	unsigned long snapshot_at;
+	unsigned long snapshot_every;
+	char *restore;
+	int rewind;
+	unsigned long rewind_interval;
+	char *ram_file;
+	int bench_startup;
+	int hugepage;
+	int cores;
 } args_t;
 
 struct _machine *machine;
+struct _host *host;
+struct _replay *replay;
+struct _snapshot *golden;
+struct _snapshot_ctl snapshot_ctl;
 
 static const uint8_t rom_txt_segment_boot_head[15] =
 	{'e', 'i', 'r', 'a', '-', '1', 0x00, 0x00,
@@ -55,6 +82,41 @@ static struct argp_option opts[] = {
 		"Dump RAM at machine shutdown"},
 	{"dump-size", 's', "RAM DUMP SIZE", OPTION_ARG_OPTIONAL,
 		"Number of RAM Bytes to dump (default 32)"},
+	{"instances", 'n', "COUNT", 0,
+		"Run COUNT headless machines on a pool of worker threads"},
+	{"workers", 'w', "COUNT", 0,
+		"Number of worker threads for --instances (default: all cores)"},
+	{"slice", 't', "INSTRUCTIONS", 0,
+		"Instructions a machine runs before yielding its worker"},
+	{"coop", 'o', 0, 0,
+		"Run all devices on one thread in a fixed order"},
+	{"record", 'R', "FILE", 0,
+		"Record all external input to FILE"},
+	{"replay", 'P', "FILE", 0,
+		"Replay a recorded run from FILE at full speed"},
+	{"snapshot", 'S', "FILE", 0,
+		"Save the machine to FILE on SIGUSR1"},
+	{"snapshot-at", 'A', "INSTRUCTIONS", 0,
+		"Also save it after INSTRUCTIONS instructions"},
+	{"snapshot-every", 'E', "INSTRUCTIONS", 0,
+		"Also save it every INSTRUCTIONS instructions, only changed"
+		" pages are written"},
+	{"rewind", 'B', "INTERVAL", OPTION_ARG_OPTIONAL,
+		"Allow the debugger to step backwards, with a checkpoint every"
+		" INTERVAL instructions"},
+	{"ram-file", 'F', "FILE", 0,
+		"Keep RAM in FILE and resume from it on the next start, snapshots"
+		" become sync points"},
+	{"restore", 'L', "FILE", 0,
+		"Start from the snapshot in FILE instead of booting, with"
+		" --instances all machines share its unmodified pages"},
+	{"hugepage", 'H', 0, 0,
+		"Back RAM with a 2 MB hugepage when the host has them"},
+	{"bench-startup", 'T', "COUNT", 0,
+		"Start a machine COUNT times and report the time to its first"
+		" instruction"},
+	{"cores", 'C', "COUNT", 0,
+		"Run the machine with COUNT cores sharing its RAM"},
 	{ 0 },
 };
 
@@ -62,6 +124,7 @@ static const char *device_table[] = {
 	DEV_IO_INPUT,
 	DEV_IO_OUTPUT,
 	DEV_PRG_LOAD,
+	DEV_DEBUG,
 	NULL
 };
 
@@ -71,14 +134,22 @@ static args_t args;
 
 void sig_handler(int signo)
 {
-	if (signo == SIGINT) {
-		machine->cpu_regs.exception |= EXC_SHUTDOWN;
-		args.debug = 1;
+	if (host) {
+		host_shutdown(host);
+		return;
 	}
-	if (signo == SIGPIPE) {
-		machine->cpu_regs.exception |= EXC_IOPORT;
-		args.debug = 1;
+
+	if (!machine)
+		return;
+
+	if (signo == SIGUSR1) {
+		if (machine->snapshot)
+			machine->snapshot->req = 1;
+		return;
 	}
+
+	replay_signal(machine, signo);
+	args.debug = 1;
 }
 
 error_t parse_opt(int key, char *arg, struct argp_state *state)
@@ -107,6 +178,53 @@ error_t parse_opt(int key, char *arg, struct argp_state *state)
 			else
 				argp_usage(state);
 			break;
+		case 'n':
+			args->instances = atoi(arg);
+			break;
+		case 'w':
+			args->workers = atoi(arg);
+			break;
+		case 't':
+			args->slice = atoi(arg);
+			break;
+		case 'o':
+			args->coop = 1;
+			break;
+		case 'R':
+			args->record = arg;
+			break;
+		case 'P':
+			args->replay = arg;
+			break;
+		case 'S':
+			args->snapshot = arg;
+			break;
+		case 'A':
+			args->snapshot_at = strtoul(arg, NULL, 0);
+			break;
+		case 'E':
+			args->snapshot_every = strtoul(arg, NULL, 0);
+			break;
+		case 'L':
+			args->restore = arg;
+			break;
+		case 'F':
+			args->ram_file = arg;
+			break;
+		case 'H':
+			args->hugepage = 1;
+			break;
+		case 'T':
+			args->bench_startup = atoi(arg);
+			break;
+		case 'B':
+			args->rewind = 1;
+			if (arg)
+				args->rewind_interval = strtoul(arg, NULL, 0);
+			break;
+		case 'C':
+			args->cores = atoi(arg);
+			break;
 		default:
 			return ARGP_ERR_UNKNOWN;
 	}
@@ -114,27 +232,287 @@ error_t parse_opt(int key, char *arg, struct argp_state *state)
 	return 0;
 }
 
-static __inline__ void mem_setup(void)
+/*
+ * Low memory at power on: boot text, loader flag, ROM and the reset
+ * program. Built once, every machine gets a copy.
+ */
+static uint8_t boot_image[MEM_START_PRG + sizeof(program_reset)];
+static int boot_image_ready;
+
+static void boot_image_build(void)
 {
-	memset(machine->RAM, 0x00, RAM_SIZE);
+	memcpy(boot_image + MEM_ROM_BOOT_MSG, rom_txt_segment_boot_head,
+		sizeof(rom_txt_segment_boot_head));
 
-	machine->mach_regs.boot_msg = (uint8_t *)&machine->RAM + MEM_ROM_BOOT_MSG;
+	memcpy(boot_image + MEM_ROM_BOOT_ANIM, rom_txt_segment_boot_anim,
+		sizeof(rom_txt_segment_boot_anim));
 
-	machine->mach_regs.boot_anim = (uint8_t *)&machine->RAM + MEM_ROM_BOOT_ANIM;
+	boot_image[MEM_PRG_LOADING] = PRG_LOADING_DONE;
 
-	machine->vdc_regs.frame_buffer = machine->RAM + MEM_START_VDC_FB;
+	memcpy(boot_image + MEM_START_ROM, rom + 4, sizeof(rom) - sizeof(struct _prg_header));
 
-	machine->mach_regs.prg_loading = (uint8_t *)&machine->RAM + MEM_PRG_LOADING;
+	memcpy(boot_image + MEM_START_PRG, program_reset, sizeof(program_reset));
 
-	*(machine->mach_regs.prg_loading) = PRG_LOADING_DONE;
+	boot_image_ready = 1;
+}
 
-	memcpy(machine->RAM + MEM_START_PRG, program_reset, sizeof(program_reset));
+/*
+ * RAM is a fresh mapping, or a new sparse RAM file, and reads as zero.
+ * Only the pages of the boot image are touched.
+ */
+static __inline__ void mem_setup(struct _machine *machine)
+{
+	if (!boot_image_ready)
+		boot_image_build();
 
-	memcpy(machine->mach_regs.boot_msg, rom_txt_segment_boot_head,
-		sizeof(rom_txt_segment_boot_head));
+	ram_attach(machine, machine->RAM);
 
-	memcpy(machine->mach_regs.boot_anim, rom_txt_segment_boot_anim,
-		sizeof(rom_txt_segment_boot_anim));
+	memcpy(machine->RAM, boot_image, sizeof(boot_image));
+}
+
+/*
+ * Bring a machine out of power on: memory, registers, ROM and any
+ * program given on the command line. The cpu is left in reset.
+ */
+static int machine_setup(struct _machine *machine, unsigned int id)
+{
+	/* attached before anything is loaded, so the log has the loads too */
+	machine->replay = args.instances ? NULL : replay;
+
+	cpu_init(machine);
+
+	ioport_init(machine);
+
+	dma_init(machine);
+
+	intc_init(machine);
+
+	counter_init(machine);
+
+	if (!args.instances && (args.snapshot || args.ram_file)) {
+		snapshot_ctl.filename = args.ram_file ? args.ram_file : args.snapshot;
+		snapshot_ctl.at = args.snapshot_at;
+		snapshot_ctl.every = snapshot_ctl.next = args.snapshot_every;
+		machine->snapshot = &snapshot_ctl;
+	}
+
+	/* RAM from a file: resume what is in there, or boot into it */
+	if (!args.instances && args.ram_file) {
+		int ret;
+
+		cpu_reset(machine);
+
+		vdc_reset(machine);
+
+		machine->cpu_regs.dbg = args.debug ? 1 : 0;
+
+		ret = snapshot_persist_open(machine, &snapshot_ctl);
+		if (ret)
+			return (ret < 0) ? ret : 0;
+	}
+
+	/*
+	 * A machine started from a snapshot gets everything, I/O registers
+	 * included, from the image. RAM is not touched here so the pages
+	 * stay shared until the guest writes them.
+	 */
+	if (golden) {
+		cpu_reset(machine);
+
+		vdc_reset(machine);
+
+		machine->cpu_regs.dbg = args.debug ? 1 : 0;
+
+		return snapshot_fork(machine, golden);
+	}
+
+	mem_setup(machine);
+
+	cpu_reset(machine);
+
+	vdc_reset(machine);
+
+	ioport_reset(machine);
+
+	dma_reset(machine);
+
+	intc_reset(machine);
+
+	counter_reset(machine);
+
+	machine->cpu_regs.dbg = args.debug ? 1 : 0;
+
+	if (args.load_program) {
+		program_load(machine, args.load_program, MEM_START_PRG);
+	}
+	/* checktest override load program */
+	if (args.machine_check) {
+		program_load_direct(machine, program_regression_test,
+			MEM_START_PRG, sizeof(program_regression_test));
+	}
+
+	return 0;
+}
+
+static int machine_host(void)
+{
+	host = host_create(args.instances, args.workers, args.slice, machine_setup);
+	if (!host)
+		return -ENOMEM;
+
+	host_run(host);
+
+	if (args.machine_check) {
+		for (int i = 0; i < host->instances; i++) {
+			host->inst[i].machine->ioport->input = IO_IN_TST_VAL;
+			host->inst[i].machine->ioport->output = IO_OUT_TST_VAL;
+
+			test_result(host->inst[i].machine->cpu_regs.GP_REG,
+				host->inst[i].machine->RAM,
+				host->inst[i].machine->cpu_regs.exception);
+		}
+
+		printf("\n%s: all tests OK.\n",__func__);
+	}
+
+	host_destroy(host);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Time from nothing to a machine that has retired its first instruction:
+ * allocation, setup and release from reset. No devices, no threads.
+ */
+static int machine_bench_startup(void)
+{
+	struct timespec start, stop;
+	double elapsed, total = 0, min = 0, max = 0;
+
+	for (int i = 0; i < args.bench_startup; i++) {
+		struct _machine *m;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		m = machine_alloc();
+		if (!m)
+			return -ENOMEM;
+
+		m->RAM = ram_alloc(args.hugepage);
+		if (!m->RAM || machine_setup(m, 0)) {
+			ram_free(m->RAM);
+			free(m);
+			return -EIO;
+		}
+
+		m->cpu_regs.reset = 0;
+		m->vdc_regs.reset = 0;
+
+		if (cpu_run(m, 1) != 1)
+			fprintf(stderr, "%s: machine did not start\n", __func__);
+
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+
+		elapsed = (stop.tv_sec - start.tv_sec) * 1e6 + (stop.tv_nsec - start.tv_nsec) / 1e3;
+
+		total += elapsed;
+		if (!i || (elapsed < min))
+			min = elapsed;
+		if (elapsed > max)
+			max = elapsed;
+
+		ram_free(m->RAM);
+		free(m);
+	}
+
+	printf("%s: %d starts, first instruction after %.1f us (min %.1f, max %.1f)\n",
+		__func__, args.bench_startup, total / args.bench_startup, min, max);
+
+	return EXIT_SUCCESS;
+}
+
+static __inline__ void machine_remove_devices(void);
+static __inline__ int machine_create_devices(void);
+
+/* the device files are only needed once the machine runs */
+static void machine_devices(void)
+{
+	if (args.replay && !args.rewind)
+		return;
+
+	if (!machine_create_devices())
+		machine->cpu_regs.exception |= EXC_IOPORT;
+}
+
+static void machine_threads(void)
+{
+	pthread_t cpu, vdc, io_in, io_out, prg, dbg;
+
+	pthread_create(&cpu, NULL, cpu_machine, machine);
+	pthread_create(&vdc, NULL, vdc_machine, machine);
+
+	/* hold the other cores before CPU can start them */
+	smp_run(machine);
+
+	machine->cpu_regs.reset = 0;
+	machine->vdc_regs.reset = 0;
+
+	machine_devices();
+
+	pthread_create(&prg, NULL, program_loader, machine);
+	pthread_create(&io_in, NULL, ioport_machine_input, machine);
+	pthread_create(&io_out, NULL, ioport_machine_output, machine);
+
+	if (machine->rewind)
+		pthread_create(&dbg, NULL, rewind_machine, machine);
+
+	pthread_join(cpu, NULL);
+
+	smp_stop(machine);
+
+	ioport_shutdown(machine);
+	program_load_cleanup();
+
+	pthread_join(vdc, NULL);
+	pthread_join(io_in, NULL);
+	pthread_join(io_out, NULL);
+	pthread_join(prg, NULL);
+
+	if (machine->rewind) {
+		rewind_cleanup();
+		pthread_join(dbg, NULL);
+	}
+}
+
+static void machine_coop(void)
+{
+	struct _sched sched;
+	int replay = machine->replay && (machine->replay->mode == REPLAY_PLAY);
+	pthread_t dbg;
+
+	/* a replay gets all input from the log and runs as fast as it can */
+	machine_devices();
+
+	sched_init(&sched, machine, !replay);
+	sched_add_machine_devices(&sched, !replay);
+
+	if (replay)
+		machine->vdc_regs.display.headless = 1;
+
+	/* the debugger takes commands on its own thread */
+	if (machine->rewind)
+		pthread_create(&dbg, NULL, rewind_machine, machine);
+
+	machine->cpu_regs.reset = 0;
+	machine->vdc_regs.reset = 0;
+
+	sched_run(&sched);
+	sched_close(&sched);
+
+	if (machine->rewind) {
+		rewind_cleanup();
+		pthread_join(dbg, NULL);
+	}
 }
 
 static __inline__ void machine_remove_devices(void)
@@ -150,14 +528,21 @@ static __inline__ void machine_remove_devices(void)
 
 static __inline__ int machine_create_devices(void)
 {
+	struct stat st;
 	int ret = 1;
 	int dev = 0;
 
-	machine_remove_devices();
-
 	mkdir("machine", 0777);
 
 	while(device_table[dev] != NULL) {
+		/* fifos left behind by an earlier run are reused */
+		if (!lstat(device_table[dev], &st) && S_ISFIFO(st.st_mode)) {
+			dev++;
+			continue;
+		}
+
+		unlink(device_table[dev]);
+
 		/* create input/output fifo */
 		if (mkfifo(device_table[dev], S_IRUSR| S_IWUSR) < 0) {
 			perror("failed to create device");
@@ -173,76 +558,132 @@ static __inline__ int machine_create_devices(void)
 int main(int argc,char *argv[])
 {
 	struct argp argp = {opts, parse_opt, args_doc, doc};
-	pthread_t cpu, vdc, io_in, io_out, prg;
-	void *status;
+	int ret;
 
 	signal(SIGINT, sig_handler);
 	signal(SIGPIPE, sig_handler);
+	signal(SIGUSR1, sig_handler);
+
+	cpu_fault_setup();
 
 	args.debug = args.machine_check = args.dump_ram = 0;
 	args.load_program = NULL;
 	args.dump_size = DUMP_RAM_SIZE_DEFAULT;
+	args.instances = 0;
+	args.workers = sysconf(_SC_NPROCESSORS_ONLN);
+	args.slice = HOST_SLICE_DEFAULT;
+	args.coop = 0;
+	args.record = args.replay = NULL;
+	args.snapshot = args.restore = NULL;
+	args.snapshot_at = args.snapshot_every = 0;
+	args.rewind = 0;
+	args.rewind_interval = REWIND_INTERVAL_DEFAULT;
+	args.ram_file = NULL;
+	args.bench_startup = 0;
+	args.hugepage = 0;
+	args.cores = 1;
 
 	argp_parse(&argp,argc,argv,0,0,&args);
 
-	machine = malloc(sizeof(struct _machine));
-	if (!machine)
-		return -ENOMEM;
+	/* the other cores only run on threads next to the first one */
+	if ((args.cores > 1) && (args.instances || args.bench_startup || args.coop ||
+	    args.record || args.replay || args.rewind || args.snapshot ||
+	    args.restore || args.ram_file)) {
+		fprintf(stderr, "--cores does not go with pooled, cooperative, recorded or saved machines\n");
+		return -EINVAL;
+	}
 
-	if (!machine_create_devices()) {
-		machine_remove_devices();
-		return -EIO;
+	if (args.restore) {
+		golden = snapshot_open(args.restore);
+		if (!golden)
+			return -EIO;
 	}
 
-	vdc_cursor_off();
+	if (args.instances) {
+		ret = machine_host();
+		snapshot_close(golden);
+		return ret;
+	}
 
-	mem_setup();
+	if (args.bench_startup) {
+		ret = machine_bench_startup();
+		snapshot_close(golden);
+		return ret;
+	}
 
-	cpu_reset(machine);
+	machine = machine_alloc();
+	if (!machine)
+		return -ENOMEM;
 
-	vdc_reset(machine);
+	machine->RAM = ram_alloc(args.hugepage);
+	if (!machine->RAM)
+		return -ENOMEM;
 
-	ioport_reset(machine);
+	if (args.replay) {
+		replay = replay_open(args.replay, REPLAY_PLAY);
+		if (!replay)
+			return -EIO;
+		/* program loads come from the log */
+		args.load_program = NULL;
+		args.coop = 1;
+	} else if (args.record) {
+		replay = replay_open(args.record, REPLAY_RECORD);
+		if (!replay) {
+			perror("cannot record");
+			return -EIO;
+		}
+	}
 
-	pthread_create(&cpu, NULL, cpu_machine, machine);
-	pthread_create(&vdc, NULL, vdc_machine, machine);
+	/* going back in time needs the inputs, keep them in memory */
+	if (args.rewind && !replay) {
+		replay = replay_open(NULL, REPLAY_RECORD);
+		if (!replay)
+			return -ENOMEM;
+	}
 
-	pthread_create(&prg, NULL, program_loader, machine);
-	pthread_create(&io_in, NULL, ioport_machine_input, machine);
-	pthread_create(&io_out, NULL, ioport_machine_output, machine);
+	if ((args.cores > 1) && smp_create(machine, args.cores)) {
+		fprintf(stderr, "cannot run %d cores, at most %d\n", args.cores, SMP_CORES_MAX);
+		return -EINVAL;
+	}
 
-	program_load_direct(machine, rom, MEM_START_ROM, sizeof(rom));
+	vdc_cursor_off();
 
-	if (args.load_program) {
-		program_load(machine, args.load_program, MEM_START_PRG);
-	}
-	/* checktest override load program */
-	if (args.machine_check) {
-		program_load_direct(machine, program_regression_test,
-			MEM_START_PRG, sizeof(program_regression_test));
+	if (machine_setup(machine, 0)) {
+		machine_remove_devices();
+		return -EIO;
 	}
 
-	machine->cpu_regs.dbg = args.debug ? 1 : 0;
+	snapshot_close(golden);
 
-	/* release CPU */
-	machine->cpu_regs.reset = 0;
-	machine->vdc_regs.reset = 0;
+	if (args.ram_file)
+		snapshot_persist_sync(machine, SNAPSHOT_RUNNING);
 
-	pthread_join(cpu, &status);
+	/*
+	 * With a log the vdc runs on the cpu, so running again repeats it
+	 * exactly and no instruction stalls on it.
+	 */
+	if (replay)
+		machine->vdc_regs.sync = 1;
 
-	ioport_shutdown((int)machine->ioport->input);
-	program_load_cleanup();
+	if (args.rewind) {
+		machine->rewind = rewind_create(machine, args.rewind_interval);
+		if (!machine->rewind) {
+			machine_remove_devices();
+			return -ENOMEM;
+		}
+	}
 
-	pthread_join(vdc, &status);
-	pthread_join(io_in, &status);
-	pthread_join(io_out, &status);
-	pthread_join(prg, &status);
+	if (args.coop)
+		machine_coop();
+	else
+		machine_threads();
 
 	if (args.machine_check) {
 		machine->ioport->input = IO_IN_TST_VAL;
 		machine->ioport->output = IO_OUT_TST_VAL;
 
-		test_result(machine->cpu_regs.GP_REG, machine->RAM);
+		test_result(machine->cpu_regs.GP_REG, machine->RAM,
+			machine->cpu_regs.exception);
 
 		printf("\n%s: all tests OK.\n",__func__);
 	}
@@ -252,10 +693,17 @@ int main(int argc,char *argv[])
 		dump_io(machine->ioport->input, machine->ioport->output);
 	}
 
-	machine_remove_devices();
+	replay_close(machine);
+
+	snapshot_persist_close(machine);
+
+	if (!args.replay || args.rewind)
+		machine_remove_devices();
 
+	rewind_destroy(machine->rewind);
+	smp_destroy(machine);
+	ram_free(machine->RAM);
 	free(machine);
-	free(status);
 
 	vdc_cursor_on();
 
@@ -24,6 +24,16 @@
 
 #define RAM_SIZE		0x80000 /* 512kb */
 
+/* granularity of dirty page tracking */
+#define RAM_PAGE_SHIFT		8
+#define RAM_PAGE_SIZE		(1 << RAM_PAGE_SHIFT)
+#define RAM_PAGES		(RAM_SIZE >> RAM_PAGE_SHIFT)
+
+/* data addresses are 16 bit offsets into the bank selected by br */
+#define MEM_BANK_SHIFT		16
+#define MEM_BANKS		(RAM_SIZE >> MEM_BANK_SHIFT)
+#define MEM_BANK(br, addr)	(((uint32_t)(br) << MEM_BANK_SHIFT) | (addr))
+
 #define MEM_START_VDC_FB	MEM_START_VDC
 #define MEM_START_VDC		0x20000 /* 128kb */
 
@@ -32,6 +42,19 @@
 
 #define MEM_START_PRG		0x1000
 
+/* grows down from the top, see call */
+#define MEM_STACK_TOP		0x1000
+#define MEM_START_STACK		0x0800
+#define MEM_STACK_SLOT		4
+
+#define MEM_START_TIMER		0x0700	/* struct _timer_regs */
+#define MEM_START_INTC		0x0600	/* struct _intc_regs */
+#define MEM_START_DMA		0x0500	/* struct _dma_regs */
+
+/* every core has its own interrupt controller and timer, core 0 first */
+#define MEM_INTC_CORE(core)	(MEM_START_INTC + (core) * 0x40)
+#define MEM_TIMER_CORE(core)	(MEM_START_TIMER + (core) * 0x10)
+
 #define MEM_IO_OUTPUT		(MEM_IO_INPUT + sizeof(uint16_t))
 #define MEM_IO_INPUT		MEM_START_IOPORT
 #define MEM_START_IOPORT	0x0400
@@ -41,6 +64,7 @@
  */
 #define MEM_START_RW		0x0400
 
+#define MEM_START_COUNTER	0x0300	/* struct _counter_regs, read only */
 #define MEM_START_ROM		0x0200
 
 #define MEM_BOOT_STATUS		0x0101
@@ -0,0 +1,108 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+
+#include "mmio.h"
+
+/*
+ * Claim the pages of region. A page belongs to one region only, so
+ * regions sharing a page are refused.
+ */
+int mmio_register(struct _machine *machine, const struct _mmio_region *region)
+{
+	struct _mmio *mmio = &machine->mmio;
+	uint32_t first = region->start >> RAM_PAGE_SHIFT;
+	uint32_t last = (region->start + region->size - 1) >> RAM_PAGE_SHIFT;
+	uint8_t flags = 0;
+
+	if (!region->size || (last >= RAM_PAGES))
+		return -EINVAL;
+
+	if (mmio->regions >= MMIO_REGIONS_MAX)
+		return -ENOSPC;
+
+	for (uint32_t p = first; p <= last; p++) {
+		if (mmio->page[p])
+			return -EBUSY;
+	}
+
+	if (region->read)
+		flags |= MMIO_READ;
+	if (region->write)
+		flags |= MMIO_WRITE;
+
+	mmio->region[mmio->regions] = *region;
+	mmio->regions++;
+
+	for (uint32_t p = first; p <= last; p++)
+		mmio->page[p] = flags | mmio->regions;
+
+	return 0;
+}
+
+void mmio_reset(struct _machine *machine)
+{
+	memset(&machine->mmio, 0x00, sizeof(struct _mmio));
+}
+
+/* a block access, handlers are called once per page they own */
+void mmio_range(struct _machine *machine, int access, uint32_t addr, uint32_t len)
+{
+	uint32_t page = addr >> RAM_PAGE_SHIFT;
+	uint32_t last = (addr + len - 1) >> RAM_PAGE_SHIFT;
+
+	if (!len)
+		return;
+
+	for (; (page <= last) && (page < RAM_PAGES); page++) {
+		uint32_t start = page << RAM_PAGE_SHIFT;
+		uint32_t end = start + RAM_PAGE_SIZE;
+
+		if (!(machine->mmio.page[page] & access))
+			continue;
+
+		if (start < addr)
+			start = addr;
+		if (end > addr + len)
+			end = addr + len;
+
+		mmio_dispatch(machine, access, start, end - start);
+	}
+}
+
+/* slow path, the page has a handler for this kind of access */
+void mmio_dispatch(struct _machine *machine, int access, uint32_t addr, uint32_t len)
+{
+	uint8_t page = machine->mmio.page[(addr >> RAM_PAGE_SHIFT) & (RAM_PAGES - 1)];
+	struct _mmio_region *region = machine->mmio.region + (page & MMIO_REGION) - 1;
+
+	/* the rest of the page is plain RAM */
+	if ((addr >= region->start + region->size) || (addr + len <= region->start))
+		return;
+
+	if (access == MMIO_READ) {
+		/* may read differently every time, a loop on it is not idle */
+		machine->cpu_regs.spin.pc = 0;
+		region->read(machine, addr, len, region->opaque);
+	} else
+		region->write(machine, addr, len, region->opaque);
+}
@@ -0,0 +1,56 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MMIO_H_
+#define __MMIO_H_
+
+#include <stdint.h>
+
+#include "machine.h"
+
+/*
+ * Memory mapped devices. A device claims a range of RAM and is called on
+ * guest accesses to it. RAM stays the backing store: a read handler runs
+ * before the cpu loads and may update the range, a write handler runs
+ * after the cpu stored. Plain RAM pages cost one table lookup.
+ */
+int mmio_register(struct _machine *machine, const struct _mmio_region *region);
+
+void mmio_reset(struct _machine *machine);
+
+void mmio_dispatch(struct _machine *machine, int access, uint32_t addr, uint32_t len);
+
+void mmio_range(struct _machine *machine, int access, uint32_t addr, uint32_t len);
+
+/* the table is indexed modulo its size, addresses past RAM fault anyway */
+static __inline__ void mmio_read(struct _machine *machine, uint32_t addr, uint32_t len)
+{
+	if (machine->mmio.page[(addr >> RAM_PAGE_SHIFT) & (RAM_PAGES - 1)] & MMIO_READ)
+		mmio_dispatch(machine, MMIO_READ, addr, len);
+}
+
+static __inline__ void mmio_write(struct _machine *machine, uint32_t addr, uint32_t len)
+{
+	if (machine->mmio.page[(addr >> RAM_PAGE_SHIFT) & (RAM_PAGES - 1)] & MMIO_WRITE)
+		mmio_dispatch(machine, MMIO_WRITE, addr, len);
+}
+
+#endif /* __MMIO_H_ */
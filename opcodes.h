@@ -247,6 +247,379 @@
 */
 #define movmr	0x16
 
+/**
+ * instruction: bank
+ *
+ * syntax: bank #value | reg
+ *
+ * select the 64 kb bank that memory operands of mov, movi, add, sub,
+ * cmp and movmr address. the address used is (bank << 16) | addr,
+ * which reaches all of RAM including the frame buffer in bank 2.
+ * accessing a bank past RAM raises an exception. the bank is 0 after
+ * reset.
+ *
+ * | 1110 1000 | 0000 | 0  | 000 | 0000 0000 0000 0000 |
+ * 0           8      12   13    16                    31
+ *    instr       MBZ  src   MBZ       #val | reg
+ *                     type
+ *
+ * example usage:
+ *  bank 2
+ *  mov @0, r1 - ram[0x20000] = r1, first character on screen
+ *  bank 0
+ */
+#define bank	0x17
+
+/**
+ * instruction: block copy
+ *
+ * syntax: bmove rd, rs, rn [, bank]
+ *
+ * copy rn bytes from address rs to address rd, the blocks may overlap.
+ * rd is in the bank selected by bank, rs too unless a source bank is
+ * given. the whole block is checked once, a block outside of RAM or a
+ * destination below MEM_START_RW raises an exception and nothing is
+ * copied. afterwards rd and rs point past the block and rn is 0.
+ *
+ * | 0001 1000 | 0000 | 0000 | 0000 | 0000     | 0000 0000 |
+ * 0           8      12     16     20         24        31
+ *    instr      rd     rs     rn    bank + 1    reserved
+ *                                   0: as rd
+ *
+ * example usage:
+ *  bank 2
+ *  bmove r1, r2, r3, 0 - copy r3 bytes from bank 0 to the frame buffer
+ */
+#define bmove	0x18
+
+/**
+ * instruction: block fill
+ *
+ * syntax: bfill rd, rv, rn
+ *
+ * set rn bytes from address rd to the low byte of rv. checked like
+ * bmove, afterwards rd points past the block and rn is 0.
+ *
+ * | 1001 1000 | 0000 | 0000 | 0000 | 0000 0000 0000 |
+ * 0           8      12     16     20             31
+ *    instr      rd     rv     rn      reserved
+ */
+#define bfill	0x19
+
+/**
+ * instruction: block compare
+ *
+ * syntax: bcomp rd, rs, rn [, bank]
+ *
+ * compare rn bytes at rd with rn bytes at rs, the result is placed in
+ * the conditional register as for cmp rd, rs. rd and rs are addressed
+ * as for bmove. if the blocks are equal rd and rs point past them and rn
+ * is 0, otherwise they are at the start of the chunk that differs.
+ *
+ * | 0101 1000 | 0000 | 0000 | 0000 | 0000     | 0000 0000 |
+ * 0           8      12     16     20         24        31
+ *    instr      rd     rs     rn    bank + 1    reserved
+ */
+#define bcomp	0x1a
+
+/**
+ * instruction: enable interrupts
+ *
+ * syntax: ei
+ *
+ * allow pending lines set in the interrupt controller mask to
+ * interrupt the cpu. interrupts are disabled after reset.
+ *
+ * | 1101 1000 | 0000 0000 0000 0000 0000 0000 |
+ * 0           8                              31
+ *    instr               reserved
+ */
+#define ei	0x1b
+
+/**
+ * instruction: disable interrupts
+ *
+ * syntax: di
+ *
+ * | 0011 1000 | 0000 0000 0000 0000 0000 0000 |
+ * 0           8                              31
+ *    instr               reserved
+ */
+#define di	0x1c
+
+/**
+ * instruction: return from interrupt
+ *
+ * syntax: reti
+ *
+ * an interrupt saves pc, cr and the bank register, selects bank 0,
+ * disables interrupts and jumps to the vector of the line. reti restores
+ * what was saved and enables interrupts again. the handler acknowledges
+ * its line before reti, or it is taken again at once.
+ *
+ * | 1011 1000 | 0000 0000 0000 0000 0000 0000 |
+ * 0           8                              31
+ *    instr               reserved
+ *
+ * example usage:
+ *  movi @1540, r1 - ack line(s) in r1
+ *  reti
+ */
+#define reti	0x1d
+
+/**
+ * instruction: wait for interrupt
+ *
+ * syntax: wfi
+ *
+ * stop until a device event: any interrupt line raised, masked or not,
+ * input, a program load or a shutdown. returns at once if an unmasked
+ * line is already pending. the instruction count stands still while
+ * waiting and moves on to the timer when it expires.
+ *
+ * | 0111 1000 | 0000 0000 0000 0000 0000 0000 |
+ * 0           8                              31
+ *    instr               reserved
+ */
+#define wfi	0x1e
+
+/**
+ * instruction: call subroutine
+ *
+ * syntax: call [address]
+ *
+ * push the address of the call on the stack and jump to address. if
+ * address is less than ROM start, the value of GP REG [register] is used
+ * instead, like jmp. the stack lives in bank 0 between 0x0800 and 0x1000
+ * and grows down in slots of 4 bytes, a full stack raises EXC_STACK.
+ *
+ * | 1111 1000 | 0000 0000 0000 0000 | 0000 0000 |
+ * 0           8                     24          31
+ *    instr         addr | register     reserved
+ */
+#define call	0x1f
+
+/**
+ * instruction: return from subroutine
+ *
+ * syntax: rts
+ *
+ * pop the address of the call and go on after it. an empty stack
+ * raises EXC_STACK.
+ *
+ * | 0000 0100 | 0000 0000 0000 0000 0000 0000 |
+ * 0           8                              31
+ *    instr               reserved
+ */
+#define rts	0x20
+
+/**
+ * instruction: push register
+ *
+ * syntax: push reg
+ *
+ * store the register in a new slot on the stack
+ *
+ * | 1000 0100 | 0000 | 0000 0000 0000 0000 0000 |
+ * 0           8      12                        31
+ *    instr      reg           reserved
+ */
+#define push	0x21
+
+/**
+ * instruction: pop register
+ *
+ * syntax: pop reg
+ *
+ * load the register from the top slot of the stack and free the slot
+ *
+ * | 0100 0100 | 0000 | 0000 0000 0000 0000 0000 |
+ * 0           8      12                        31
+ *    instr      reg           reserved
+ *
+ * example usage:
+ *  push r1
+ *  call r5 - subroutine at the address in r5, may use r1
+ *  pop r1
+ */
+#define pop	0x22
+
+/*
+ * the alu instructions below take the forms of add and work on all 16
+ * bits: a register and an immediate, a register or memory, or memory and
+ * a register. unlike add, a memory source or destination is a 16 bit
+ * word. none of them touch cr.
+ */
+
+/**
+ * instruction: multiply
+ *
+ * syntax: mul dest, source
+ *
+ * dest = dest * source, the low 16 bits of the product
+ *
+ * | 1100 0100 | 0000 | 00  | 00 | 0000 0000 0000 0000 |
+ * 0           8      12    14   16                    31
+ *                reg  src    dst   #val | @mem | reg
+ *                     type   type
+ *
+ * example usage:
+ *  mul r0, 10  - r0 = r0 * 10
+ */
+#define mul	0x23
+
+/**
+ * instruction: divide unsigned
+ *
+ * syntax: divu dest, source
+ *
+ * dest = dest / source. a source of 0 raises EXC_DIV. named divu so it
+ * does not hide div() from stdlib.h
+ *
+ * | 0010 0100 | 0000 | 00  | 00 | 0000 0000 0000 0000 |
+ * 0           8      12    14   16                    31
+ *                reg  src    dst   #val | @mem | reg
+ *                     type   type
+ *
+ * example usage:
+ *  divu r0, r1  - r0 = r0 / r1
+ */
+#define divu	0x24
+
+/**
+ * instruction: remainder unsigned
+ *
+ * syntax: modu dest, source
+ *
+ * dest = dest % source. a source of 0 raises EXC_DIV
+ *
+ * | 1010 0100 | 0000 | 00  | 00 | 0000 0000 0000 0000 |
+ * 0           8      12    14   16                    31
+ *                reg  src    dst   #val | @mem | reg
+ *                     type   type
+ *
+ * example usage:
+ *  modu r0, 10  - r0 = r0 % 10
+ */
+#define modu	0x25
+
+/**
+ * instruction: bitwise and
+ *
+ * syntax: and dest, source
+ *
+ * dest = dest & source
+ *
+ * | 0110 0100 | 0000 | 00  | 00 | 0000 0000 0000 0000 |
+ * 0           8      12    14   16                    31
+ *                reg  src    dst   #val | @mem | reg
+ *                     type   type
+ *
+ * example usage:
+ *  and r0, 255  - keep the low byte
+ */
+#define and	0x26
+
+/**
+ * instruction: bitwise or
+ *
+ * syntax: or dest, source
+ *
+ * dest = dest | source
+ *
+ * | 1110 0100 | 0000 | 00  | 00 | 0000 0000 0000 0000 |
+ * 0           8      12    14   16                    31
+ *                reg  src    dst   #val | @mem | reg
+ *                     type   type
+ *
+ * example usage:
+ *  mov r1, 4
+ *  or @1026, r1 - set output pin 2
+ */
+#define or	0x27
+
+/**
+ * instruction: bitwise exclusive or
+ *
+ * syntax: xor dest, source
+ *
+ * dest = dest ^ source
+ *
+ * | 0001 0100 | 0000 | 00  | 00 | 0000 0000 0000 0000 |
+ * 0           8      12    14   16                    31
+ *                reg  src    dst   #val | @mem | reg
+ *                     type   type
+ *
+ * example usage:
+ *  xor r0, r0  - r0 = 0
+ */
+#define xor	0x28
+
+/**
+ * instruction: bitwise not
+ *
+ * syntax: not dest
+ *
+ * dest = ~dest, dest is a register or memory
+ *
+ * | 1001 0100 | 0000 | 00  | 00 | 0000 0000 0000 0000 |
+ * 0           8      12    14   16                    31
+ *                reg  MBZ    dst        @mem
+ *                            type
+ */
+#define not	0x29
+
+/**
+ * instruction: shift left
+ *
+ * syntax: shl dest, source
+ *
+ * dest = dest << source, zeros shifted in. only the low 4 bits of source count
+ *
+ * | 0101 0100 | 0000 | 00  | 00 | 0000 0000 0000 0000 |
+ * 0           8      12    14   16                    31
+ *                reg  src    dst   #val | @mem | reg
+ *                     type   type
+ *
+ * example usage:
+ *  shl r0, 4  - r0 = r0 * 16
+ */
+#define shl	0x2a
+
+/**
+ * instruction: shift right
+ *
+ * syntax: shr dest, source
+ *
+ * dest = dest >> source, zeros shifted in. only the low 4 bits of source count
+ *
+ * | 1101 0100 | 0000 | 00  | 00 | 0000 0000 0000 0000 |
+ * 0           8      12    14   16                    31
+ *                reg  src    dst   #val | @mem | reg
+ *                     type   type
+ *
+ * example usage:
+ *  shr r0, 8  - the high byte
+ */
+#define shr	0x2b
+
+/**
+ * instruction: shift arithmetic right
+ *
+ * syntax: sar dest, source
+ *
+ * dest = dest >> source, copies of the sign bit shifted in. only the low 4 bits of source count
+ *
+ * | 0011 0100 | 0000 | 00  | 00 | 0000 0000 0000 0000 |
+ * 0           8      12    14   16                    31
+ *                reg  src    dst   #val | @mem | reg
+ *                     type   type
+ *
+ * example usage:
+ *  sar r0, 1  - signed r0 / 2, rounded down
+ */
+#define sar	0x2c
+
 
 
 /**
@@ -349,5 +722,168 @@
  */
 #define diputpixel		0x36
 
+/**
+ * instruction: load / store indexed
+ *
+ * syntax: ldb reg, base [, offset]
+ *         ldb reg, base+ [, step]
+ *         (ldw, stb and stw alike)
+ *
+ * ldb and ldw load a byte or a 16 bit word into reg, stb and stw store
+ * the low byte or the word of reg. the address is base + offset in the
+ * bank selected by br. with p set (base+) the address is base itself and
+ * the step is added to base after the access, the step defaults to the
+ * size of the access and may be negative to walk down. a load into base
+ * keeps the loaded value.
+ *
+ * | 0000 0010 | 0000 | 0000 | 000 | 0 | 0000 0000 0000 |
+ * 0           8      12     16    19  20             31
+ *    instr      reg    base   MBZ   p    offset (signed)
+ *
+ * example usage:
+ *  ldb r0, r1+ - r0 = ram[r1], r1 = r1 + 1
+ *  stw r0, r2, 6 - ram[r2 + 6] = r0
+ */
+#define ldb	0x40
+#define ldw	0x41
+#define stb	0x42
+#define stw	0x43
+
+#define OP_LDST_POST		(1 << 19)
+#define OP_LDST_OFFSET(instr)	((int32_t)(instr) >> 20)
+
+/**
+ * instruction: vector operations
+ *
+ * syntax: vaddb rd, rs, rn
+ *         (vsubb, vminb, vmaxb, vcmpb and the word forms vaddw, ...)
+ *
+ * work lane by lane on two vectors of rn elements at rd and rs in the
+ * bank selected by br, bytes for the b forms and 16 bit words for the
+ * w forms. the result is written to the vector at rd:
+ *
+ *  vadd - rd[i] + rs[i], wrapping
+ *  vsub - rd[i] - rs[i], wrapping
+ *  vmin - the smaller of rd[i] and rs[i], unsigned
+ *  vmax - the larger of rd[i] and rs[i], unsigned
+ *  vcmp - all ones where rd[i] equals rs[i], 0 elsewhere
+ *
+ * vectors are checked and stepped as for bmove, afterwards rd and rs
+ * point past them and rn is 0. lanes are done in ascending order, a rd
+ * just above rs sees the lanes already written.
+ *
+ * | 0100 0100 | 0000 | 0000 | 0000 | 0 | 000 0000 0000 |
+ * 0           8      12     16     20  21            31
+ *    instr      rd     rs     rn    w     reserved
+ *
+ * example usage:
+ *  vmaxw r1, r2, r3 - clip r3 samples at r1 to the floor at r2
+ */
+#define vadd	0x44
+#define vsub	0x45
+#define vmin	0x46
+#define vmax	0x47
+#define vcmp	0x48
+
+/**
+ * instruction: vector sum
+ *
+ * syntax: vsumb rd, rs, rn
+ *         vsumw rd, rs, rn
+ *
+ * add the rn elements at rs to register rd, which is not cleared first.
+ * the sum wraps at 16 bits. afterwards rs points past the vector and rn
+ * is 0.
+ *
+ * | 0100 1001 | 0000 | 0000 | 0000 | 0 | 000 0000 0000 |
+ * 0           8      12     16     20  21            31
+ *    instr      rd     rs     rn    w     reserved
+ */
+#define vsum	0x49
+
+#define OP_VEC_WORD		(1 << 20)
+
+/**
+ * instruction: host call
+ *
+ * syntax: hcall service
+ *
+ * run a service of the host (hcall.h) on the registers, arguments are
+ * taken from r1 upwards and the result is left in r0. an unknown
+ * service is an invalid instruction.
+ *
+ * | 0100 1010 | 0000 0000 | 0000 0000 0000 0000 |
+ * 0           8           16                  31
+ *    instr      service      reserved
+ *
+ * example usage:
+ *  hcall 3 - r0 = crc of r2 bytes at r1, starting from r3
+ */
+#define hcall	0x4a
+
+/**
+ * instruction: core id
+ *
+ * syntax: cpuid rd
+ *
+ * rd = number of the core running it, 0 for the first core.
+ *
+ * | 0100 1011 | 0000 | 0000 0000 0000 0000 0000 |
+ * 0           8      12                       31
+ *    instr      rd     reserved
+ */
+#define cpuid	0x4b
+
+/**
+ * instruction: start core
+ *
+ * syntax: cstart rc, ra
+ *
+ * start the held core rc at address ra. cr is EQ if it was started. a
+ * core that is running already gets IRQ_CORE instead and cr is NEQ, as
+ * it is for a core that does not exist. all stores done before cstart
+ * are seen by the started core.
+ *
+ * | 0100 1100 | 0000 | 0000 | 0000 0000 0000 0000 |
+ * 0           8      12     16                  31
+ *    instr      rc     ra      reserved
+ */
+#define cstart	0x4c
+
+/**
+ * instruction: compare and swap
+ *
+ * syntax: cas rx, ra, rn
+ *
+ * atomically: if the word at ra in the bank selected by br equals rx,
+ * store rn there and set cr to EQ. otherwise load the word into rx and
+ * set cr to NEQ. ra must be even and writable.
+ *
+ * | 0100 1101 | 0000 | 0000 | 0000 | 0000 0000 0000 |
+ * 0           8      12     16     20             31
+ *    instr      rx     ra     rn      reserved
+ *
+ * example usage:
+ *  cas r0, r1, r2 - take the lock at r1 if it still holds r0
+ */
+#define cas	0x4d
+
+/**
+ * instruction: fetch and add
+ *
+ * syntax: xadd rd, ra
+ *
+ * atomically add rd to the word at ra in the bank selected by br, rd
+ * gets the word as it was before. ra must be even and writable.
+ *
+ * | 0100 1110 | 0000 | 0000 | 0000 0000 0000 0000 |
+ * 0           8      12     16                  31
+ *    instr      rd     ra      reserved
+ *
+ * example usage:
+ *  xadd r0, r1 - take ticket r0 from the counter at r1
+ */
+#define xadd	0x4e
+
 
 #endif /* __OPCODES_H__ */
@@ -21,12 +21,38 @@
 
 #include "prg.h"
 #include "exception.h"
+#include "replay.h"
+#include "ram.h"
 
 #define PRG_DEBUG(x) x
 
+/*
+ * Copy a code segment into RAM. Programs reach the machine through the
+ * input log, this is where the log lands them.
+ */
+void program_load_image(struct _machine *machine, uint32_t addr, const void *code, uint32_t size)
+{
+	if ((addr + size) > RAM_SIZE) {
+		machine->cpu_regs.exception = EXC_PRG;
+		return;
+	}
+
+	*machine->mach_regs.prg_loading = PRG_LOADING;
+
+	dma_host_write(machine, addr, code, size);
+
+	*machine->mach_regs.prg_loading = PRG_LOADING_DONE;
+
+	ram_mark_dirty(machine, MEM_PRG_LOADING, 1);
+
+	intc_raise(machine, IRQ_PRG_LOAD);
+}
+
 void program_load(struct _machine *machine, const char filename[], uint16_t addr) {
 	FILE *prog;
-	struct _prg_format program;
+	struct _prg_header header;
+	uint8_t *image;
+	uint32_t image_addr = addr;
 	int r;
 
 	prog = fopen(filename,"rb");
@@ -37,54 +63,60 @@ void program_load(struct _machine *machine, const char filename[], uint16_t addr
 	}
 	PRG_DEBUG(printf("loading %s\n", filename));
 
-	r = fread(&program.header, sizeof(struct _prg_header), 1, prog);
+	r = fread(&header, sizeof(struct _prg_header), 1, prog);
 	if (r != 1) {
 		PRG_DEBUG(printf("cannot open program %s: Corrupt header.\n", filename));
 		goto prg_load_close;
 	}
 
-	if (program.header.magic != PRG_MAGIC_HEADER) {
+	if (header.magic != PRG_MAGIC_HEADER) {
 		PRG_DEBUG(printf("cannot open program %s: Missing magic in header.\n", filename));
 		goto prg_load_close;
 	}
 
-	if (program.header.code_size > (RAM_SIZE - MEM_START_PRG)) {
+	if (header.code_size > (RAM_SIZE - MEM_START_PRG)) {
 		machine->cpu_regs.exception = EXC_PRG;
 		PRG_DEBUG(printf("cannot open program %s: Not enough memory.\n", filename));
 		goto prg_load_close;
 	}
 
-
-	program.code_segment = malloc(program.header.code_size * sizeof(uint8_t));
-	if (!program.code_segment){
+	/* load address first, then the code segment */
+	image = malloc(sizeof(image_addr) + header.code_size);
+	if (!image){
 		goto prg_load_close;
 	}
 
+	memcpy(image, &image_addr, sizeof(image_addr));
 
-	r = fread(program.code_segment,program.header.code_size, 1, prog);
+	r = fread(image + sizeof(image_addr), header.code_size, 1, prog);
 	if (r != 1) {
 			PRG_DEBUG(printf("cannot open program %s: Code segment corrupt.\n", filename));
 			goto prg_load_free;
 	}
-	
-	*machine->mach_regs.prg_loading = PRG_LOADING;
-	
-	memcpy(&machine->RAM[addr], program.code_segment, program.header.code_size);
 
-	*machine->mach_regs.prg_loading = PRG_LOADING_DONE;
-	
+	replay_post(machine, REPLAY_PRG_LOAD, image, sizeof(image_addr) + header.code_size);
+
 prg_load_free:
-	free(program.code_segment);
+	free(image);
 prg_load_close:
 	fclose(prog);
 }
 
 void program_load_direct(struct _machine *machine, const uint32_t *prg, uint16_t addr, int prg_size) {
-	*machine->mach_regs.prg_loading = PRG_LOADING;
+	uint32_t code_size = prg_size - sizeof(struct _prg_header);
+	uint32_t image_addr = addr;
+	uint8_t *image;
 
-	memcpy(&machine->RAM[addr], prg + 4, prg_size);
+	image = malloc(sizeof(image_addr) + code_size);
+	if (!image)
+		return;
 
-	*machine->mach_regs.prg_loading = PRG_LOADING_DONE;
+	memcpy(image, &image_addr, sizeof(image_addr));
+	memcpy(image + sizeof(image_addr), prg + 4, code_size);
+
+	replay_post(machine, REPLAY_PRG_LOAD, image, sizeof(image_addr) + code_size);
+
+	free(image);
 }
 
 void program_load_cleanup(void)
@@ -134,3 +166,40 @@ void *program_loader(void *mach)
 
 	pthread_exit(NULL);
 }
+
+/*
+ * Non blocking program loader. The loader fifo is kept open between
+ * polls in *fd.
+ */
+void program_loader_poll(void *mach, int *fd)
+{
+	struct _machine *machine = mach;
+	char prg_name[PRG_NAME_MAX] = { 0 };
+	char *save_ptr;
+
+	if (*fd < 0) {
+		*fd = open(DEV_PRG_LOAD, O_RDONLY | O_NONBLOCK);
+		if (*fd < 0) {
+			perror("unable to setup program loader");
+			machine->cpu_regs.exception = EXC_PRG;
+			return;
+		}
+	}
+
+	int l = read(*fd, prg_name, sizeof(prg_name) - 1);
+
+	if (l == -1) {
+		if (errno != EAGAIN)
+			perror("error while loading program");
+		return;
+	}
+
+	if (l == 0)
+		return;
+
+	/* remove traling newline */
+	strtok_r(prg_name, "\n", &save_ptr);
+
+	if (!machine->cpu_regs.panic && !machine->cpu_regs.reset)
+		program_load(machine, prg_name, MEM_START_PRG);
+}
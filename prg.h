@@ -42,6 +42,8 @@ struct _prg_format {
 	uint32_t *code_segment;
 };
 
+void program_load_image(struct _machine *machine, uint32_t addr, const void *code, uint32_t size);
+
 void program_load(struct _machine *machine, const char filename[], uint16_t addr);
 
 void program_load_direct(struct _machine *machine, const uint32_t *prg, uint16_t addr, int prg_size);
@@ -50,4 +52,6 @@ void program_load_cleanup(void);
 
 void *program_loader(void *mach);
 
+void program_loader_poll(void *mach, int *fd);
+
 #endif /* __PRG_H_ */
@@ -0,0 +1,216 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "ram.h"
+
+#define RAM_WINDOW_SIZE		(RAM_MAP_SIZE + RAM_GUARD_SIZE)
+#define RAM_WINDOW(ram)		((ram) - (RAM_MAP_SIZE - RAM_SIZE))
+
+/*
+ * Reserve a window aligned to a hugepage. Only address space is taken,
+ * the caller maps RAM over the end of the first RAM_MAP_SIZE bytes and
+ * the rest stays inaccessible.
+ */
+static uint8_t *ram_reserve(void)
+{
+	uint8_t *area, *window;
+
+	area = mmap(NULL, RAM_WINDOW_SIZE + RAM_HUGEPAGE_SIZE, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (area == MAP_FAILED)
+		return NULL;
+
+	window = (uint8_t *)(((uintptr_t)area + RAM_HUGEPAGE_SIZE - 1) &
+		~((uintptr_t)RAM_HUGEPAGE_SIZE - 1));
+
+	if (window > area)
+		munmap(area, window - area);
+
+	munmap(window + RAM_WINDOW_SIZE, (area + RAM_HUGEPAGE_SIZE) - window);
+
+	return window;
+}
+
+/*
+ * Machine RAM is always a mapping in a window of its own, either anonymous
+ * or of a RAM image in a file, so all of it is released the same way.
+ *
+ * With hugepage the whole hugepage below the guard is made accessible and
+ * handed to the kernel as a transparent hugepage candidate, one TLB entry
+ * then covers RAM. Where the host has no hugepages this is plain RAM.
+ */
+uint8_t *ram_alloc(int hugepage)
+{
+	uint8_t *window, *ram;
+
+	window = ram_reserve();
+	if (!window)
+		return NULL;
+
+	ram = window + (RAM_MAP_SIZE - RAM_SIZE);
+
+	if (hugepage) {
+		if (mmap(window, RAM_MAP_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+			goto ram_alloc_fail;
+
+		madvise(window, RAM_MAP_SIZE, MADV_HUGEPAGE);
+	} else {
+		if (mmap(ram, RAM_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+			goto ram_alloc_fail;
+	}
+
+	return ram;
+
+ram_alloc_fail:
+	munmap(window, RAM_WINDOW_SIZE);
+	return NULL;
+}
+
+/*
+ * A private mapping gives the machine its own copy of the image, a shared
+ * one writes RAM through to the file.
+ */
+uint8_t *ram_map_file(int fd, off_t offset, int shared)
+{
+	uint8_t *window, *ram;
+
+	window = ram_reserve();
+	if (!window)
+		return NULL;
+
+	ram = window + (RAM_MAP_SIZE - RAM_SIZE);
+
+	if (mmap(ram, RAM_SIZE, PROT_READ | PROT_WRITE,
+		(shared ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED, fd, offset) == MAP_FAILED) {
+		munmap(window, RAM_WINDOW_SIZE);
+		return NULL;
+	}
+
+	return ram;
+}
+
+void ram_free(uint8_t *ram)
+{
+	if (ram)
+		munmap(RAM_WINDOW(ram), RAM_WINDOW_SIZE);
+}
+
+/*
+ * Number of pages the machine has its own copy of. A page of a file
+ * mapping that was never written is still shared with the page cache.
+ */
+unsigned int ram_private_pages(uint8_t *ram)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	unsigned int pages = RAM_SIZE / page_size;
+	uint64_t entry[pages];
+	unsigned int private = 0;
+	int fd;
+
+	fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	if (pread(fd, entry, sizeof(entry),
+		((uintptr_t)ram / page_size) * sizeof(uint64_t)) != sizeof(entry)) {
+		close(fd);
+		return 0;
+	}
+
+	close(fd);
+
+	/* bit 63: present, bit 61: file page or shared */
+	for (int p = 0; p < pages; p++) {
+		if ((entry[p] >> 63) && !((entry[p] >> 61) & 1))
+			private++;
+	}
+
+	return private;
+}
+
+/*
+ * Move the dirty pages of a channel into map and start over. Returns the
+ * number of dirty pages.
+ */
+unsigned int ram_dirty_collect(struct _machine *machine, int channel, uint64_t *map)
+{
+	unsigned int pages = 0;
+
+	for (int w = 0; w < (RAM_PAGES / 64); w++) {
+		map[w] = __atomic_exchange_n(&machine->dirty[channel][w], 0, __ATOMIC_RELAXED);
+		pages += __builtin_popcountll(map[w]);
+	}
+
+	return pages;
+}
+
+/*
+ * Take the dirty pages of a channel in [addr, addr + len) only, the rest
+ * of the channel is left alone. Returns non zero if any of them was
+ * written.
+ */
+int ram_dirty_range(struct _machine *machine, int channel, uint32_t addr, uint32_t len)
+{
+	uint32_t page = addr >> RAM_PAGE_SHIFT;
+	uint32_t last = (addr + len - 1) >> RAM_PAGE_SHIFT;
+	uint64_t dirty = 0;
+
+	if (!len)
+		return 0;
+
+	if (last >= RAM_PAGES)
+		last = RAM_PAGES - 1;
+
+	for (; page <= last; page = (page | 63) + 1) {
+		uint32_t end = ((page | 63) < last) ? (page | 63) : last;
+		uint64_t mask = (~0ULL >> (63 - (end - page))) << (page % 64);
+
+		dirty |= __atomic_fetch_and(&machine->dirty[channel][page / 64], ~mask,
+			__ATOMIC_RELAXED) & mask;
+	}
+
+	return dirty != 0;
+}
+
+/* point the machine and its memory mapped registers at RAM */
+void ram_attach(struct _machine *machine, uint8_t *ram)
+{
+	machine->RAM = ram;
+
+	machine->mach_regs.boot_msg = ram + MEM_ROM_BOOT_MSG;
+	machine->mach_regs.boot_anim = ram + MEM_ROM_BOOT_ANIM;
+	machine->mach_regs.prg_loading = ram + MEM_PRG_LOADING;
+
+	machine->vdc_regs.frame_buffer = ram + MEM_START_VDC_FB;
+
+	machine->ioport = (struct _io_regs *)(ram + MEM_START_IOPORT);
+	machine->dma = (struct _dma_regs *)(ram + MEM_START_DMA);
+	machine->intc = (struct _intc_regs *)(ram + MEM_INTC_CORE(machine->cpu_regs.core));
+	machine->timer = (struct _timer_regs *)(ram + MEM_TIMER_CORE(machine->cpu_regs.core));
+	machine->counter = (struct _counter_regs *)(ram + MEM_START_COUNTER);
+}
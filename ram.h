@@ -0,0 +1,88 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RAM_H_
+#define __RAM_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "machine.h"
+
+#define RAM_HUGEPAGE_SIZE	(2 << 20)
+
+/*
+ * Every RAM mapping ends a hugepage aligned window of its own and is
+ * followed by a guard area no guest address can reach past, so accesses
+ * outside of RAM fault instead of being checked.
+ */
+#define RAM_MAP_SIZE	(((RAM_SIZE) + RAM_HUGEPAGE_SIZE - 1) & ~(RAM_HUGEPAGE_SIZE - 1))
+#define RAM_GUARD_SIZE	(1ULL << 32)
+
+uint8_t *ram_alloc(int hugepage);
+
+uint8_t *ram_map_file(int fd, off_t offset, int shared);
+
+void ram_free(uint8_t *ram);
+
+unsigned int ram_private_pages(uint8_t *ram);
+
+void ram_attach(struct _machine *machine, uint8_t *ram);
+
+unsigned int ram_dirty_collect(struct _machine *machine, int channel, uint64_t *map);
+
+int ram_dirty_range(struct _machine *machine, int channel, uint32_t addr, uint32_t len);
+
+/* true if addr is in the guard area behind ram */
+static __inline__ int ram_guard_hit(uint8_t *ram, void *addr)
+{
+	return ((uintptr_t)addr - (uintptr_t)(ram + RAM_SIZE)) < RAM_GUARD_SIZE;
+}
+
+/*
+ * Every write to RAM outside of the cpu registers goes through here. The
+ * vdc and the cpu can run on different threads, so bits are only ever
+ * set atomically.
+ */
+static __inline__ void ram_mark_dirty(struct _machine *machine, uint32_t addr, uint32_t len)
+{
+	uint32_t page = addr >> RAM_PAGE_SHIFT;
+	uint32_t last = (addr + len - 1) >> RAM_PAGE_SHIFT;
+
+	if (last >= RAM_PAGES)
+		last = RAM_PAGES - 1;
+
+	if (machine->watch && ((machine->watch_addr - addr) < len))
+		machine->watch_hit = machine->cpu_regs.icount;
+
+	for (; page <= last; page++) {
+		uint64_t bit = 1ULL << (page % 64);
+
+		for (int c = 0; c < RAM_DIRTY_CHANNELS; c++) {
+			uint64_t *word = &machine->dirty[c][page / 64];
+
+			if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit))
+				__atomic_or_fetch(word, bit, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+#endif /* __RAM_H_ */
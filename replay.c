@@ -0,0 +1,484 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Record and replay of external inputs.
+ *
+ * Everything that reaches the machine from the outside goes through
+ * replay_post() or replay_signal() and is applied by the cpu between two
+ * instructions. When recording, each input is also written to the log
+ * together with the number of instructions retired before it. A replay
+ * applies the logged inputs at the same instruction counts and ignores
+ * live input.
+ *
+ * The log is also kept in memory while recording, so a machine that was
+ * rewound (see rewind.c) gets the same inputs again until it catches up
+ * with the point where live input stopped.
+ *
+ * Log format, after a magic and version word:
+ *   varint icount delta | type byte | varint length | data
+ */
+
+#include "replay.h"
+#include "machine.h"
+#include "exception.h"
+#include "prg.h"
+#include "ram.h"
+
+#define REPLAY_DEBUG(x) x
+
+static void replay_apply(struct _machine *machine, uint8_t type, const uint8_t *data, uint32_t len)
+{
+	uint32_t addr;
+
+	/* a value the guest read from the host, not an input */
+	if (type == REPLAY_COUNTERS) {
+		counter_logged(machine, data, len);
+		return;
+	}
+
+	/* any input ends a wfi, when it is applied so a replay does the same */
+	cpu_event(machine);
+
+	switch (type) {
+		case REPLAY_IO_INPUT:
+			if (memcmp(&machine->ioport->input, data, sizeof(uint16_t)))
+				intc_raise(machine, IRQ_IO_INPUT);
+			memcpy(&machine->ioport->input, data, sizeof(uint16_t));
+			ram_mark_dirty(machine, MEM_IO_INPUT, sizeof(uint16_t));
+			break;
+		case REPLAY_PRG_LOAD:
+			memcpy(&addr, data, sizeof(uint32_t));
+			program_load_image(machine, addr, data + sizeof(uint32_t),
+				len - sizeof(uint32_t));
+			break;
+		case REPLAY_QUIT:
+			machine->cpu_regs.panic = 1;
+			break;
+		case REPLAY_SIGNAL:
+			if (data[0] == SIGINT)
+				machine->cpu_regs.exception |= EXC_SHUTDOWN;
+			if (data[0] == SIGPIPE)
+				machine->cpu_regs.exception |= EXC_IOPORT;
+			break;
+		default:
+			break;
+	}
+}
+
+static size_t replay_put_varint(uint8_t *out, uint64_t val)
+{
+	size_t n = 0;
+
+	do {
+		uint8_t b = val & 0x7f;
+
+		val >>= 7;
+		if (val)
+			b |= 0x80;
+		out[n++] = b;
+	} while (val);
+
+	return n;
+}
+
+static void replay_append(struct _replay *replay, const void *data, size_t len)
+{
+	if ((replay->size + len) > replay->alloc) {
+		size_t alloc = replay->alloc ? replay->alloc : 4096;
+		uint8_t *buf;
+
+		while (alloc < (replay->size + len))
+			alloc *= 2;
+
+		buf = realloc(replay->buf, alloc);
+		if (!buf)
+			return;
+
+		replay->buf = buf;
+		replay->alloc = alloc;
+	}
+
+	memcpy(replay->buf + replay->size, data, len);
+	replay->size += len;
+}
+
+static int replay_get_varint(struct _replay *replay, uint64_t *val)
+{
+	int shift = 0;
+
+	*val = 0;
+
+	while (replay->pos < replay->size) {
+		uint8_t b = replay->buf[replay->pos++];
+
+		*val |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 1;
+		shift += 7;
+	}
+
+	return 0;
+}
+
+static void replay_write(struct _replay *replay, uint64_t icount, uint8_t type,
+	const uint8_t *data, uint32_t len)
+{
+	uint8_t head[21];
+	size_t n;
+
+	n = replay_put_varint(head, icount - replay->write_icount);
+	head[n++] = type;
+	n += replay_put_varint(head + n, len);
+
+	replay_append(replay, head, n);
+	if (len)
+		replay_append(replay, data, len);
+
+	replay->write_icount = icount;
+
+	if (!replay->log)
+		return;
+
+	fwrite(head, n, 1, replay->log);
+	if (len)
+		fwrite(data, len, 1, replay->log);
+
+	/* inputs are rare, keep the log usable if the host goes down */
+	fflush(replay->log);
+}
+
+/* find the next logged input, the current one is at buf[pos] */
+static void replay_parse(struct _replay *replay)
+{
+	uint64_t delta;
+	uint64_t len;
+	size_t start = replay->pos;
+
+	replay->next_valid = 0;
+
+	if (!replay_get_varint(replay, &delta) || (replay->pos >= replay->size))
+		return;
+
+	replay->pos++; /* type */
+
+	if (!replay_get_varint(replay, &len) || (len > replay->size - replay->pos))
+		return;
+
+	replay->pos = start;
+	replay->next_icount = replay->last_icount + delta;
+	replay->next_valid = 1;
+}
+
+/* apply the next logged input, or only step over it */
+static void replay_play_next(struct _machine *machine, int apply)
+{
+	struct _replay *replay = machine->replay;
+	uint64_t delta;
+	uint64_t len;
+	uint8_t type;
+
+	replay_get_varint(replay, &delta);
+	type = replay->buf[replay->pos++];
+	replay_get_varint(replay, &len);
+
+	replay->last_icount = replay->next_icount;
+
+	if (!apply) {
+		replay->pos += len;
+		replay_parse(replay);
+		return;
+	}
+
+	if (type == REPLAY_END) {
+		REPLAY_DEBUG(printf("\nreplay: end of log after %llu instructions\n",
+			(unsigned long long)replay->last_icount));
+		machine->cpu_regs.panic = 1;
+		replay->next_valid = 0;
+		return;
+	}
+
+	replay_apply(machine, type, replay->buf + replay->pos, len);
+	replay->pos += len;
+
+	replay_parse(replay);
+}
+
+struct _replay *replay_open(const char *filename, enum replay_mode mode)
+{
+	struct _replay *replay;
+	uint32_t header[2] = { REPLAY_MAGIC, REPLAY_VERSION };
+	long size;
+
+	replay = calloc(1, sizeof(struct _replay));
+	if (!replay)
+		return NULL;
+
+	replay->mode = mode;
+	pthread_mutex_init(&replay->lock, NULL);
+
+	if (mode == REPLAY_RECORD) {
+		/* without a file the log only lives in memory */
+		if (filename) {
+			replay->log = fopen(filename, "wb");
+			if (!replay->log)
+				goto replay_open_fail;
+
+			fwrite(header, sizeof(header), 1, replay->log);
+		}
+
+		replay_append(replay, header, sizeof(header));
+		replay->pos = replay->size;
+		return replay;
+	}
+
+	replay->log = fopen(filename, "rb");
+	if (!replay->log)
+		goto replay_open_fail;
+
+	fseek(replay->log, 0, SEEK_END);
+	size = ftell(replay->log);
+	fseek(replay->log, 0, SEEK_SET);
+
+	if (size < sizeof(header))
+		goto replay_open_corrupt;
+
+	replay->buf = malloc(size);
+	if (!replay->buf || (fread(replay->buf, size, 1, replay->log) != 1))
+		goto replay_open_corrupt;
+
+	memcpy(header, replay->buf, sizeof(header));
+	if ((header[0] != REPLAY_MAGIC) || (header[1] != REPLAY_VERSION))
+		goto replay_open_corrupt;
+
+	replay->size = replay->alloc = size;
+	replay->pos = sizeof(header);
+	replay_parse(replay);
+
+	return replay;
+
+replay_open_corrupt:
+	REPLAY_DEBUG(printf("cannot replay %s: Not a valid log.\n", filename));
+replay_open_fail:
+	if (replay->log)
+		fclose(replay->log);
+	free(replay->buf);
+	free(replay);
+	return NULL;
+}
+
+void replay_close(struct _machine *machine)
+{
+	struct _replay *replay = machine->replay;
+	struct _replay_event *event;
+
+	if (!replay)
+		return;
+
+	machine->replay = NULL;
+
+	if (replay->mode == REPLAY_RECORD)
+		replay_write(replay, machine->cpu_regs.icount, REPLAY_END, NULL, 0);
+
+	while (replay->head) {
+		event = replay->head;
+		replay->head = event->next;
+		free(event);
+	}
+
+	if (replay->log)
+		fclose(replay->log);
+	free(replay->buf);
+	free(replay);
+}
+
+/*
+ * Hand an external input to the machine. Without a log it takes effect
+ * at once, as it always has.
+ */
+void replay_post(struct _machine *machine, uint8_t type, const void *data, uint32_t len)
+{
+	struct _replay *replay = machine->replay;
+	struct _replay_event *event;
+
+	if (!replay) {
+		replay_apply(machine, type, data, len);
+		return;
+	}
+
+	/* live input is ignored, the log is the only source */
+	if (replay->mode == REPLAY_PLAY)
+		return;
+
+	event = malloc(sizeof(struct _replay_event) + len);
+	if (!event)
+		return;
+
+	event->next = NULL;
+	event->type = type;
+	event->len = len;
+	if (len)
+		memcpy(event->data, data, len);
+
+	pthread_mutex_lock(&replay->lock);
+	if (replay->tail)
+		replay->tail->next = event;
+	else
+		replay->head = event;
+	replay->tail = event;
+	__atomic_store_n(&replay->pending, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&replay->lock);
+
+	/* a cpu sleeping in wfi applies it now, not on its next instruction */
+	cpu_kick(machine);
+}
+
+/*
+ * Log a value the cpu took from the host during the current instruction.
+ * A replay gets it back before the same instruction.
+ */
+void replay_log(struct _machine *machine, uint8_t type, const void *data, uint32_t len)
+{
+	struct _replay *replay = machine->replay;
+
+	if (!replay || (replay->mode != REPLAY_RECORD))
+		return;
+
+	replay_write(replay, machine->cpu_regs.icount, type, data, len);
+}
+
+/*
+ * Called from a signal handler, so only a flag is set. The cpu takes the
+ * signal between two instructions, see replay_signals(). A waiting cpu
+ * looks for it every CPU_WAIT_MS.
+ */
+void replay_signal(struct _machine *machine, int signo)
+{
+	__atomic_or_fetch(&machine->signals, 1 << signo, __ATOMIC_RELEASE);
+}
+
+/*
+ * Apply the host signals that came in, on the cpu thread. A recording
+ * logs them first. A replay has its signals in the log, a live one still
+ * ends it but is not logged.
+ */
+void replay_signals(struct _machine *machine)
+{
+	struct _replay *replay = machine->replay;
+	int signals = __atomic_exchange_n(&machine->signals, 0, __ATOMIC_ACQ_REL);
+
+	for (uint8_t sig = 0; sig < 32; sig++) {
+		if (!(signals & (1 << sig)))
+			continue;
+
+		if (replay && (replay->mode == REPLAY_RECORD))
+			replay_write(replay, machine->cpu_regs.icount, REPLAY_SIGNAL,
+				&sig, sizeof(sig));
+		replay_apply(machine, REPLAY_SIGNAL, &sig, sizeof(sig));
+	}
+}
+
+/*
+ * While the machine runs from the log, the instruction count of its next
+ * input, UINT64_MAX if there is none. Returns 0 when live input drives it.
+ */
+int replay_next(struct _machine *machine, uint64_t *icount)
+{
+	struct _replay *replay = machine->replay;
+
+	if (!replay)
+		return 0;
+
+	if ((replay->mode != REPLAY_PLAY) && (machine->cpu_regs.icount >= replay->horizon))
+		return 0;
+
+	*icount = replay->next_valid ? replay->next_icount : UINT64_MAX;
+
+	return 1;
+}
+
+/*
+ * Called by the cpu before each instruction.
+ */
+void replay_sync(struct _machine *machine)
+{
+	struct _replay *replay = machine->replay;
+	struct _replay_event *event;
+
+	/*
+	 * A rewound machine gets the logged input until it catches up. A cpu
+	 * in wfi syncs many times at one instruction count, live input keeps
+	 * coming in there until it has the logged input of a later one.
+	 */
+	if ((replay->mode == REPLAY_PLAY) || (machine->cpu_regs.icount < replay->horizon) ||
+	    (replay->next_valid && (replay->next_icount == machine->cpu_regs.icount))) {
+		while (replay->next_valid && (replay->next_icount == machine->cpu_regs.icount))
+			replay_play_next(machine, 1);
+
+		if ((replay->mode == REPLAY_PLAY) && __atomic_load_n(&machine->signals, __ATOMIC_ACQUIRE))
+			replay_signals(machine);
+		return;
+	}
+
+	replay->horizon = machine->cpu_regs.icount;
+
+	if (__atomic_load_n(&machine->signals, __ATOMIC_ACQUIRE))
+		replay_signals(machine);
+
+	if (!__atomic_load_n(&replay->pending, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&replay->lock);
+	event = replay->head;
+	replay->head = replay->tail = NULL;
+	replay->pending = 0;
+	pthread_mutex_unlock(&replay->lock);
+
+	while (event) {
+		struct _replay_event *next = event->next;
+
+		replay_write(replay, machine->cpu_regs.icount, event->type,
+			event->data, event->len);
+		replay_apply(machine, event->type, event->data, event->len);
+		free(event);
+
+		event = next;
+	}
+}
+
+/*
+ * Position the log at the first input applied at or after icount. The
+ * machine is about to run again from there.
+ */
+void replay_seek(struct _machine *machine, uint64_t icount)
+{
+	struct _replay *replay = machine->replay;
+
+	if (!replay)
+		return;
+
+	replay->pos = 2 * sizeof(uint32_t);
+	replay->last_icount = 0;
+	replay_parse(replay);
+
+	while (replay->next_valid && (replay->next_icount < icount))
+		replay_play_next(machine, 0);
+}
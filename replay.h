@@ -0,0 +1,95 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REPLAY_H_
+#define __REPLAY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define REPLAY_MAGIC	0xe113a1e0
+#define REPLAY_VERSION	1
+
+struct _machine;
+
+enum replay_mode {
+	REPLAY_RECORD,
+	REPLAY_PLAY,
+};
+
+enum replay_type {
+	REPLAY_IO_INPUT = 1,	/* uint16_t input port value */
+	REPLAY_PRG_LOAD,	/* uint32_t address, code */
+	REPLAY_QUIT,		/* display window closed */
+	REPLAY_SIGNAL,		/* uint8_t signal number */
+	REPLAY_END,		/* recording stopped */
+	REPLAY_COUNTERS,	/* uint64_t host ns, vdc stalls read by the guest */
+};
+
+struct _replay_event {
+	struct _replay_event *next;
+	uint8_t type;
+	uint32_t len;
+	uint8_t data[];
+};
+
+struct _replay {
+	enum replay_mode mode;
+	FILE *log;		/* NULL when only kept in memory */
+	uint64_t write_icount;
+	uint64_t horizon;	/* instructions that ran with live input */
+
+	/* record: inputs waiting for the next instruction boundary */
+	pthread_mutex_t lock;
+	struct _replay_event *head;
+	struct _replay_event *tail;
+	int pending;
+
+	/* play, a recording is also kept here */
+	uint8_t *buf;
+	size_t size;
+	size_t alloc;
+	size_t pos;
+	uint64_t last_icount;
+	uint64_t next_icount;
+	int next_valid;
+};
+
+struct _replay *replay_open(const char *filename, enum replay_mode mode);
+
+void replay_close(struct _machine *machine);
+
+void replay_post(struct _machine *machine, uint8_t type, const void *data, uint32_t len);
+
+void replay_log(struct _machine *machine, uint8_t type, const void *data, uint32_t len);
+
+void replay_signal(struct _machine *machine, int signo);
+
+void replay_signals(struct _machine *machine);
+
+void replay_sync(struct _machine *machine);
+
+int replay_next(struct _machine *machine, uint64_t *icount);
+
+void replay_seek(struct _machine *machine, uint64_t icount);
+
+#endif /* __REPLAY_H_ */
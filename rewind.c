@@ -0,0 +1,512 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reverse execution for the debugger.
+ *
+ * Every interval instructions the registers are saved together with an
+ * undo record of the RAM pages written since the previous checkpoint. To
+ * go back, the machine is put back to the last checkpoint before the
+ * target and run forward to it. All external input comes from the input
+ * log on the way, so the machine does exactly what it did the first time.
+ *
+ * Commands are written to the debug device, one per line:
+ *   b		stop
+ *   c		continue
+ *   s [N]	run N instructions and stop
+ *   r [N]	go back N instructions
+ *   g N	go to instruction N
+ *   w ADDR	go back to the last write to ADDR
+ *   q		shut the machine down
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "rewind.h"
+#include "machine.h"
+#include "exception.h"
+#include "replay.h"
+#include "ram.h"
+#include "opcodes.h"
+#include "utils.h"
+
+#define REWIND_DEBUG(x)	x
+
+#define REWIND_WAIT_MS	100
+
+static __inline__ int page_test(const uint64_t *map, uint32_t page)
+{
+	return (map[page / 64] >> (page % 64)) & 1;
+}
+
+static void rewind_drop(struct _rewind *rw, unsigned int count)
+{
+	for (unsigned int c = 0; c < count; c++) {
+		free(rw->cp[c].page);
+		free(rw->cp[c].data);
+	}
+
+	rw->count -= count;
+	memmove(rw->cp, rw->cp + count, rw->count * sizeof(struct _rewind_checkpoint));
+}
+
+static void rewind_checkpoint(struct _machine *machine)
+{
+	struct _rewind *rw = machine->rewind;
+	struct _rewind_checkpoint *cp;
+	uint64_t dirty[RAM_PAGES / 64];
+	unsigned int pages, n = 0;
+
+	/* the oldest checkpoint goes, no way back beyond the next one */
+	if (rw->count == REWIND_CHECKPOINTS_MAX)
+		rewind_drop(rw, 1);
+
+	cp = rw->cp + rw->count - 1;
+
+	pages = ram_dirty_collect(machine, RAM_DIRTY_REWIND, dirty);
+
+	cp->page = malloc(pages * sizeof(uint32_t));
+	cp->data = malloc(pages * RAM_PAGE_SIZE);
+	if (pages && (!cp->page || !cp->data)) {
+		REWIND_DEBUG(printf("\nrewind: out of memory, history dropped\n"));
+		rewind_drop(rw, rw->count);
+		cp = NULL;
+	}
+
+	for (uint32_t p = 0; p < RAM_PAGES; p++) {
+		uint32_t offset = p << RAM_PAGE_SHIFT;
+
+		if (!page_test(dirty, p))
+			continue;
+
+		if (cp) {
+			cp->page[n] = p;
+			memcpy(cp->data + n * RAM_PAGE_SIZE, rw->shadow + offset, RAM_PAGE_SIZE);
+			n++;
+		}
+		memcpy(rw->shadow + offset, machine->RAM + offset, RAM_PAGE_SIZE);
+	}
+
+	if (cp)
+		cp->pages = n;
+
+	cp = rw->cp + rw->count++;
+	memset(cp, 0x00, sizeof(struct _rewind_checkpoint));
+	cp->icount = machine->cpu_regs.icount;
+	snapshot_get_regs(machine, &cp->cpu, &cp->vdc);
+
+	rw->next = cp->icount + rw->interval;
+}
+
+static void rewind_copy_page(struct _machine *machine, uint32_t page, const uint8_t *data)
+{
+	uint32_t offset = page << RAM_PAGE_SHIFT;
+
+	memcpy(machine->RAM + offset, data, RAM_PAGE_SIZE);
+	ram_mark_dirty(machine, offset, RAM_PAGE_SIZE);
+}
+
+/* put the machine back to checkpoint c, later checkpoints are dropped */
+static void rewind_restore(struct _machine *machine, unsigned int c)
+{
+	struct _rewind *rw = machine->rewind;
+	struct _rewind_checkpoint *cp;
+	uint64_t dirty[RAM_PAGES / 64];
+
+	/* back to the latest checkpoint */
+	ram_dirty_collect(machine, RAM_DIRTY_REWIND, dirty);
+
+	for (uint32_t p = 0; p < RAM_PAGES; p++) {
+		if (page_test(dirty, p))
+			rewind_copy_page(machine, p, rw->shadow + (p << RAM_PAGE_SHIFT));
+	}
+
+	/* and undo one interval after the other */
+	while (rw->count > (c + 1)) {
+		rw->count--;
+		cp = rw->cp + rw->count - 1;
+
+		for (unsigned int n = 0; n < cp->pages; n++) {
+			uint8_t *data = cp->data + n * RAM_PAGE_SIZE;
+
+			rewind_copy_page(machine, cp->page[n], data);
+			memcpy(rw->shadow + (cp->page[n] << RAM_PAGE_SHIFT), data, RAM_PAGE_SIZE);
+		}
+
+		free(cp->page);
+		free(cp->data);
+		cp->page = NULL;
+		cp->data = NULL;
+		cp->pages = 0;
+	}
+
+	/* RAM and shadow match again */
+	ram_dirty_collect(machine, RAM_DIRTY_REWIND, dirty);
+
+	cp = rw->cp + c;
+	snapshot_set_regs(machine, &cp->cpu, &cp->vdc);
+	vdc_display_select(&machine->vdc_regs);
+
+	replay_seek(machine, cp->icount);
+
+	rw->next = cp->icount + rw->interval;
+}
+
+/* run forward at full speed without stopping for commands */
+static void rewind_run(struct _machine *machine, uint64_t target)
+{
+	struct _rewind *rw = machine->rewind;
+
+	rw->replaying = 1;
+
+	/* a cpu in wfi with nothing logged ahead of it stops short */
+	while ((machine->cpu_regs.icount < target) &&
+	       !machine->cpu_regs.panic && !machine->cpu_regs.reset) {
+		uint64_t icount = machine->cpu_regs.icount;
+
+		if (!cpu_run(machine, target - icount) && (machine->cpu_regs.icount == icount))
+			break;
+	}
+
+	rw->replaying = 0;
+}
+
+static void rewind_goto(struct _machine *machine, uint64_t target)
+{
+	struct _rewind *rw = machine->rewind;
+	unsigned int c = rw->count - 1;
+
+	if (target < rw->cp[0].icount)
+		target = rw->cp[0].icount;
+
+	if (target < machine->cpu_regs.icount) {
+		while (c && (rw->cp[c].icount > target))
+			c--;
+
+		rewind_restore(machine, c);
+	}
+
+	rewind_run(machine, target);
+}
+
+/*
+ * Search the intervals backwards for one that wrote the page of addr,
+ * then run it again watching addr itself.
+ */
+static void rewind_last_write(struct _machine *machine, uint32_t addr)
+{
+	struct _rewind *rw = machine->rewind;
+	uint64_t now = machine->cpu_regs.icount;
+	uint64_t end = now;
+	uint32_t page = addr >> RAM_PAGE_SHIFT;
+
+	if (addr >= RAM_SIZE) {
+		printf("rewind: 0x%x is not in RAM\n", addr);
+		return;
+	}
+
+	for (int c = rw->count - 1; c >= 0; c--) {
+		struct _rewind_checkpoint *cp = rw->cp + c;
+		int written = 0;
+
+		if (c == (rw->count - 1)) {
+			written = page_test(machine->dirty[RAM_DIRTY_REWIND], page);
+		} else {
+			for (unsigned int n = 0; (n < cp->pages) && !written; n++)
+				written = (cp->page[n] == page);
+		}
+
+		if (written) {
+			uint64_t start = cp->icount;
+
+			rewind_restore(machine, c);
+
+			machine->watch_hit = -1;
+			machine->watch_addr = addr;
+			machine->watch = 1;
+			rewind_run(machine, end);
+			machine->watch = 0;
+
+			if (machine->watch_hit >= 0) {
+				rewind_goto(machine, machine->watch_hit + 1);
+				return;
+			}
+
+			end = start;
+			continue;
+		}
+
+		end = cp->icount;
+	}
+
+	printf("rewind: no write to 0x%x\n", addr);
+	rewind_goto(machine, now);
+}
+
+static void rewind_show(struct _machine *machine)
+{
+	int sp = machine->cpu_regs.sp;
+
+	printf("\nrewind: stopped at instruction %llu, pc 0x%lx, sp 0x%x\n",
+		(unsigned long long)machine->cpu_regs.icount, machine->cpu_regs.pc, sp);
+	dump_instr(machine->cpu_regs.dbg_info, machine->cpu_regs.dbg_index);
+	dump_regs(machine->cpu_regs.GP_REG);
+
+	/* top of the stack, return addresses and pushed registers alike */
+	printf("Stack:\n=========\n");
+	for (int s = 0; (s < REWIND_STACK_SHOW) && (sp >= MEM_START_STACK) &&
+	     (sp + MEM_STACK_SLOT <= MEM_STACK_TOP); s++, sp += MEM_STACK_SLOT)
+		printf("0x%x:\t0x%x\n", sp, *(uint32_t *)(machine->RAM + sp));
+	fflush(stdout);
+}
+
+/* returns 1 when the machine should run again */
+static int rewind_command(struct _machine *machine, const char *cmd)
+{
+	struct _rewind *rw = machine->rewind;
+	uint64_t icount = machine->cpu_regs.icount;
+	unsigned long long arg;
+	int args;
+
+	args = sscanf(cmd + 1, "%lli", &arg);
+
+	switch (cmd[0]) {
+		case 'b':
+			rw->stopped = 1;
+			break;
+		case 'c':
+			rw->stopped = 0;
+			return 1;
+		case 's':
+			rw->stop_at = icount + ((args == 1) ? arg : 1);
+			rw->stopped = 0;
+			return 1;
+		case 'r':
+			if (args != 1)
+				arg = 1;
+			rewind_goto(machine, (arg < icount) ? icount - arg : 0);
+			break;
+		case 'g':
+			if (args != 1)
+				return 0;
+			if (arg > icount) {
+				rw->stop_at = arg;
+				rw->stopped = 0;
+				return 1;
+			}
+			rewind_goto(machine, arg);
+			break;
+		case 'w':
+			if (args != 1)
+				return 0;
+			rewind_last_write(machine, arg);
+			break;
+		case 'f':
+			/* run until this subroutine returns */
+			rw->finish_sp = machine->cpu_regs.sp;
+			rw->stopped = 0;
+			return 1;
+		case 'q':
+			machine->cpu_regs.exception |= EXC_SHUTDOWN;
+			rw->stopped = 0;
+			return 1;
+		default:
+			return 0;
+	}
+
+	rewind_show(machine);
+
+	return 0;
+}
+
+/* a signal waits for the cpu, let it take it */
+static __inline__ int rewind_interrupted(struct _machine *machine)
+{
+	return __atomic_load_n(&machine->signals, __ATOMIC_ACQUIRE);
+}
+
+static void rewind_debugger(struct _machine *machine)
+{
+	struct _rewind *rw = machine->rewind;
+	char cmd[REWIND_CMD_MAX];
+	struct timespec timeout;
+
+	for (;;) {
+		pthread_mutex_lock(&rw->lock);
+
+		while (!rw->pending && rw->stopped && !rewind_interrupted(machine)) {
+			clock_gettime(CLOCK_REALTIME, &timeout);
+			timeout.tv_nsec += REWIND_WAIT_MS * 1000000L;
+			if (timeout.tv_nsec >= 1000000000L) {
+				timeout.tv_sec++;
+				timeout.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&rw->cmd_ready, &rw->lock, &timeout);
+		}
+
+		if (!rw->pending) {
+			pthread_mutex_unlock(&rw->lock);
+			return;
+		}
+
+		memcpy(cmd, rw->cmd, sizeof(cmd));
+		rw->pending = 0;
+
+		pthread_mutex_unlock(&rw->lock);
+
+		if (rewind_command(machine, cmd))
+			return;
+	}
+}
+
+/*
+ * Called by the cpu on every instruction boundary, before any input is
+ * applied to it.
+ */
+void rewind_poll(struct _machine *machine)
+{
+	struct _rewind *rw = machine->rewind;
+
+	if (machine->cpu_regs.icount >= rw->next)
+		rewind_checkpoint(machine);
+
+	if (rw->replaying)
+		return;
+
+	if (rw->stop_at && (machine->cpu_regs.icount >= rw->stop_at)) {
+		rw->stop_at = 0;
+		rw->stopped = 1;
+		rewind_show(machine);
+	}
+
+	/* rts to the caller, pc is back on the call */
+	if (rw->finish_sp && (machine->cpu_regs.sp > rw->finish_sp) &&
+	    (machine->RAM[machine->cpu_regs.pc] == call)) {
+		rw->finish_sp = 0;
+		rw->stopped = 1;
+		rewind_show(machine);
+	}
+
+	if (rw->stopped || __atomic_load_n(&rw->pending, __ATOMIC_ACQUIRE))
+		rewind_debugger(machine);
+}
+
+struct _rewind *rewind_create(struct _machine *machine, uint64_t interval)
+{
+	struct _rewind *rw;
+	uint64_t dirty[RAM_PAGES / 64];
+
+	rw = calloc(1, sizeof(struct _rewind));
+	if (!rw)
+		return NULL;
+
+	rw->shadow = malloc(RAM_SIZE);
+	rw->cp = calloc(REWIND_CHECKPOINTS_MAX, sizeof(struct _rewind_checkpoint));
+	if (!rw->shadow || !rw->cp) {
+		rewind_destroy(rw);
+		return NULL;
+	}
+
+	rw->interval = interval ? interval : REWIND_INTERVAL_DEFAULT;
+
+	pthread_mutex_init(&rw->lock, NULL);
+	pthread_cond_init(&rw->cmd_ready, NULL);
+
+	memcpy(rw->shadow, machine->RAM, RAM_SIZE);
+	ram_dirty_collect(machine, RAM_DIRTY_REWIND, dirty);
+
+	rw->cp[0].icount = machine->cpu_regs.icount;
+	snapshot_get_regs(machine, &rw->cp[0].cpu, &rw->cp[0].vdc);
+	rw->count = 1;
+	rw->next = rw->cp[0].icount + rw->interval;
+
+	return rw;
+}
+
+void rewind_destroy(struct _rewind *rw)
+{
+	if (!rw)
+		return;
+
+	if (rw->cp) {
+		rewind_drop(rw, rw->count);
+		free(rw->cp);
+	}
+
+	free(rw->shadow);
+	free(rw);
+}
+
+void rewind_cleanup(void)
+{
+	int fd;
+
+	fd = open(DEV_DEBUG, O_RDWR);
+	if (fd == -1)
+		return;
+
+	if (write(fd, "\n", 1) != 1)
+		perror("problem in rewind_cleanup()");
+
+	close(fd);
+}
+
+void *rewind_machine(void *mach)
+{
+	struct _machine *machine = mach;
+	struct _rewind *rw = machine->rewind;
+	char cmd[REWIND_CMD_MAX];
+	char *save_ptr;
+
+	while (!machine->cpu_regs.panic) {
+		int fd = open(DEV_DEBUG, O_RDONLY);
+
+		if (fd < 0) {
+			perror("unable to setup debugger");
+			pthread_exit(NULL);
+		}
+
+		memset(cmd, 0x00, sizeof(cmd));
+		int l = read(fd, cmd, sizeof(cmd) - 1);
+		close(fd);
+
+		if (l <= 0)
+			continue;
+
+		strtok_r(cmd, "\n", &save_ptr);
+		if (cmd[0] == '\n')
+			continue;
+
+		REWIND_DEBUG(printf("\nrewind: %s\n", cmd));
+
+		pthread_mutex_lock(&rw->lock);
+		memcpy(rw->cmd, cmd, sizeof(rw->cmd));
+		rw->pending = 1;
+		pthread_cond_signal(&rw->cmd_ready);
+		pthread_mutex_unlock(&rw->lock);
+	}
+
+	pthread_exit(NULL);
+}
@@ -0,0 +1,80 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REWIND_H_
+#define __REWIND_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "snapshot.h"
+
+#define DEV_DEBUG		"machine/debug"
+
+#define REWIND_INTERVAL_DEFAULT	10000	/* instructions between checkpoints */
+#define REWIND_CHECKPOINTS_MAX	4096
+#define REWIND_CMD_MAX		64
+#define REWIND_STACK_SHOW	8	/* stack slots shown on a stop */
+
+struct _machine;
+
+/*
+ * Registers at a checkpoint, and the RAM pages written before the next
+ * checkpoint with their contents at this one.
+ */
+struct _rewind_checkpoint {
+	uint64_t icount;
+	struct _snapshot_cpu cpu;
+	struct _snapshot_vdc vdc;
+	unsigned int pages;
+	uint32_t *page;
+	uint8_t *data;
+};
+
+struct _rewind {
+	uint8_t *shadow;		/* RAM at the latest checkpoint */
+	struct _rewind_checkpoint *cp;
+	unsigned int count;
+	uint64_t interval;
+	uint64_t next;			/* instruction of the next checkpoint */
+	uint64_t stop_at;		/* stop after a step, 0 for none */
+	int finish_sp;			/* stop on the rts above it, 0 for none */
+	int stopped;
+	int replaying;			/* running again to a point in the past */
+
+	/* commands from the debug device */
+	pthread_mutex_t lock;
+	pthread_cond_t cmd_ready;
+	char cmd[REWIND_CMD_MAX];
+	int pending;
+};
+
+struct _rewind *rewind_create(struct _machine *machine, uint64_t interval);
+
+void rewind_destroy(struct _rewind *rw);
+
+void rewind_poll(struct _machine *machine);
+
+void rewind_cleanup(void);
+
+void *rewind_machine(void *mach);
+
+#endif /* __REWIND_H_ */
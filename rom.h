@@ -26,8 +26,19 @@
 #include "registers.h"
 #include "prg.h"
 #include "vdc.h"
+#include "memory.h"
+#include "intc.h"
+
+#define ROM_IDLE_PERIOD		35	/* instructions, half a second at the master clock */
 
 const uint32_t program_reset[] = {
+	/* no program yet, sleep until one is loaded or the animation is due */
+	(mov << 0) | (R0 << 8) | OP_DST_REG | (ROM_IDLE_PERIOD << 16),
+	(movi << 0) | (R0 << 8) | OP_DST_MEM | (TIMER_REG(period) << 16),
+	(mov << 0) | (R0 << 8) | OP_DST_REG | (TIMER_ENABLE << 16),
+	(movi << 0) | (R0 << 8) | OP_DST_MEM | (TIMER_REG(ctrl) << 16),
+	(wfi << 0),
+
 	/* jump back to start of ROM */
 	(jmp << 0) | ((MEM_START_ROM + (sizeof(struct _prg_header) / sizeof(uint32_t))) << 8),
 	(nop << 0),
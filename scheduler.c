@@ -0,0 +1,208 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cooperative device scheduler.
+ *
+ * All devices of one machine run on the calling thread. Each device is a
+ * small state machine that does one step of work per activation and is
+ * then queued again, one period later in guest time. The queue is ordered
+ * on guest ticks, so the interleaving of cpu, vdc and i/o is the same on
+ * every run regardless of host load.
+ */
+
+#include "scheduler.h"
+#include "prg.h"
+#include "exception.h"
+
+static void sched_cpu_tick(struct _machine *machine, struct _sched_device *dev)
+{
+	/* a waiting cpu lets its cycles pass, they count for the timer */
+	if (!cpu_run(machine, 1) && machine->cpu_regs.waiting)
+		cpu_idle(machine, 1);
+}
+
+static void sched_vdc_tick(struct _machine *machine, struct _sched_device *dev)
+{
+	vdc_tick(machine);
+}
+
+static void sched_io_input_tick(struct _machine *machine, struct _sched_device *dev)
+{
+	ioport_poll_input(machine, &dev->fd);
+}
+
+static void sched_io_output_tick(struct _machine *machine, struct _sched_device *dev)
+{
+	ioport_poll_output(machine);
+}
+
+static void sched_prg_tick(struct _machine *machine, struct _sched_device *dev)
+{
+	program_loader_poll(machine, &dev->fd);
+}
+
+/* same rates as the device threads: cpu @ mclk, vdc @ 2 * mclk, i/o @ 4 * mclk */
+static const struct _sched_device machine_devices[] = {
+	{ "cpu", SCHED_TICKS_PER_CYCLE, 0, 0, -1, sched_cpu_tick },
+	{ "vdc", SCHED_TICKS_PER_CYCLE / 2, 0, 1, -1, sched_vdc_tick },
+};
+
+/* devices fed from device files */
+static const struct _sched_device machine_external_devices[] = {
+	{ "io_in", 1, 0, 2, -1, sched_io_input_tick },
+	{ "io_out", 1, 0, 3, -1, sched_io_output_tick },
+	{ "prg", SCHED_TICKS_PER_CYCLE, 0, 4, -1, sched_prg_tick },
+};
+
+static __inline__ int sched_before(struct _sched_device *a, struct _sched_device *b)
+{
+	return (a->next < b->next) || ((a->next == b->next) && (a->order < b->order));
+}
+
+static void sched_sift_down(struct _sched *sched, int i)
+{
+	for (;;) {
+		int l = 2 * i + 1;
+		int r = l + 1;
+		int m = i;
+
+		if ((l < sched->devices) && sched_before(sched->queue[l], sched->queue[m]))
+			m = l;
+		if ((r < sched->devices) && sched_before(sched->queue[r], sched->queue[m]))
+			m = r;
+		if (m == i)
+			return;
+
+		struct _sched_device *t = sched->queue[i];
+		sched->queue[i] = sched->queue[m];
+		sched->queue[m] = t;
+		i = m;
+	}
+}
+
+static void sched_sift_up(struct _sched *sched, int i)
+{
+	while (i) {
+		int p = (i - 1) / 2;
+
+		if (!sched_before(sched->queue[i], sched->queue[p]))
+			return;
+
+		struct _sched_device *t = sched->queue[i];
+		sched->queue[i] = sched->queue[p];
+		sched->queue[p] = t;
+		i = p;
+	}
+}
+
+static void sched_wait(struct _sched *sched)
+{
+	struct timespec due;
+	uint64_t ns;
+
+	ns = (sched->now * 1000000000ULL) /
+		((uint64_t)sched->machine->cpu_regs.mclk * SCHED_TICKS_PER_CYCLE);
+
+	due.tv_sec = sched->start.tv_sec + ns / 1000000000ULL;
+	due.tv_nsec = sched->start.tv_nsec + ns % 1000000000ULL;
+	if (due.tv_nsec >= 1000000000L) {
+		due.tv_sec++;
+		due.tv_nsec -= 1000000000L;
+	}
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+		;
+}
+
+void sched_init(struct _sched *sched, struct _machine *machine, int throttle)
+{
+	memset(sched, 0x00, sizeof(struct _sched));
+
+	sched->machine = machine;
+	sched->throttle = throttle;
+}
+
+struct _sched_device *sched_add(struct _sched *sched, const struct _sched_device *dev)
+{
+	struct _sched_device *d;
+
+	if (sched->devices >= SCHED_DEVICE_MAX)
+		return NULL;
+
+	d = sched->dev + sched->devices;
+	*d = *dev;
+	d->next = sched->now;
+
+	sched->queue[sched->devices] = d;
+	sched_sift_up(sched, sched->devices++);
+
+	return d;
+}
+
+void sched_add_machine_devices(struct _sched *sched, int external)
+{
+	for (int d = 0; d < sizeof(machine_devices) / sizeof(machine_devices[0]); d++)
+		sched_add(sched, machine_devices + d);
+
+	if (!external)
+		return;
+
+	for (int d = 0; d < sizeof(machine_external_devices) / sizeof(machine_external_devices[0]); d++)
+		sched_add(sched, machine_external_devices + d);
+}
+
+/*
+ * Run until the cpu halts. Devices due at the same tick run in the
+ * order they were given.
+ */
+void sched_run(struct _sched *sched)
+{
+	struct _machine *machine = sched->machine;
+	struct _sched_device *dev;
+
+	clock_gettime(CLOCK_MONOTONIC, &sched->start);
+
+	while (!machine->cpu_regs.panic && sched->devices) {
+		dev = sched->queue[0];
+
+		sched->now = dev->next;
+
+		if (sched->throttle)
+			sched_wait(sched);
+
+		dev->tick(machine, dev);
+
+		dev->next += dev->period;
+		sched_sift_down(sched, 0);
+	}
+}
+
+void sched_close(struct _sched *sched)
+{
+	for (int d = 0; d < sched->devices; d++) {
+		if (sched->dev[d].fd >= 0)
+			close(sched->dev[d].fd);
+		sched->dev[d].fd = -1;
+	}
+
+	vdc_close(sched->machine);
+}
@@ -0,0 +1,66 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SCHEDULER_H_
+#define __SCHEDULER_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include "machine.h"
+
+/*
+ * The scheduler clock ticks four times per cpu cycle, which is the
+ * rate of the fastest device (the i/o port).
+ */
+#define SCHED_TICKS_PER_CYCLE	4
+#define SCHED_DEVICE_MAX	8
+
+struct _sched_device {
+	const char *name;
+	uint64_t period;	/* ticks between activations */
+	uint64_t next;		/* tick of next activation */
+	int order;		/* breaks ties between devices due at the same tick */
+	int fd;			/* device file kept open by the device, or -1 */
+	void (*tick)(struct _machine *machine, struct _sched_device *dev);
+};
+
+struct _sched {
+	struct _machine *machine;
+	struct _sched_device dev[SCHED_DEVICE_MAX];
+	struct _sched_device *queue[SCHED_DEVICE_MAX];	/* min-heap on next */
+	int devices;
+	uint64_t now;
+	int throttle;		/* follow the master clock in wall time */
+	struct timespec start;
+};
+
+void sched_init(struct _sched *sched, struct _machine *machine, int throttle);
+
+struct _sched_device *sched_add(struct _sched *sched, const struct _sched_device *dev);
+
+void sched_add_machine_devices(struct _sched *sched, int external);
+
+void sched_run(struct _sched *sched);
+
+void sched_close(struct _sched *sched);
+
+#endif /* __SCHEDULER_H_ */
@@ -0,0 +1,236 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * More cores in one machine.
+ *
+ * Every core is a machine of its own on the RAM of the first one, so the
+ * interpreter runs unchanged on each of them, one host thread per core.
+ * The other cores are held until a running core starts them with cstart.
+ * A halt or a fault holds a core again, only a halt of core 0 ends the
+ * machine.
+ *
+ * Plain loads and stores of different cores are not ordered against each
+ * other. cas and xadd are host atomics and full barriers, and cstart
+ * publishes all stores done before it to the core it starts.
+ */
+
+#include "smp.h"
+#include "machine.h"
+#include "intc.h"
+#include "ram.h"
+#include "vdc.h"
+
+int smp_create(struct _machine *machine, int cores)
+{
+	struct _smp *smp;
+
+	if ((cores < 1) || (cores > SMP_CORES_MAX))
+		return -EINVAL;
+
+	smp = calloc(1, sizeof(struct _smp));
+	if (!smp)
+		return -ENOMEM;
+
+	smp->cores = cores;
+	smp->core[0] = machine;
+	smp->state[0] = SMP_RUNNING;
+
+	machine->smp = smp;
+
+	for (int c = 1; c < cores; c++) {
+		smp->core[c] = machine_alloc();
+		if (!smp->core[c]) {
+			smp_destroy(machine);
+			return -ENOMEM;
+		}
+
+		smp->core[c]->smp = smp;
+		smp->core[c]->cpu_regs.core = c;
+	}
+
+	return 0;
+}
+
+/* the frame buffer is drawn by the vdc of core 0, tell it what changed */
+static void smp_display_dirty(struct _machine *core)
+{
+	struct _machine *boot = core->smp->core[0];
+	uint32_t size = adapter_mode[boot->vdc_regs.display.mode].resolution;
+
+	if (ram_dirty_range(core, RAM_DIRTY_DISPLAY, MEM_START_VDC_FB, size))
+		ram_mark_dirty(boot, MEM_START_VDC_FB, size);
+}
+
+/* halted or faulted, wait for the next cstart */
+static void smp_park(struct _machine *core)
+{
+	cpu_reset(core);
+
+	intc_reset(core);
+
+	__atomic_store_n(&core->smp->state[core->cpu_regs.core], SMP_HELD, __ATOMIC_RELEASE);
+}
+
+static void *smp_core(void *arg)
+{
+	struct _machine *core = arg;
+	struct _smp *smp = core->smp;
+	struct timespec cpu_clk_freq;
+
+	cpu_clk_freq.tv_sec = 0;
+
+	while (!__atomic_load_n(&smp->stop, __ATOMIC_ACQUIRE)) {
+
+		cpu_clk_freq.tv_nsec = 1000000000 / core->cpu_regs.mclk;
+
+		/* pairs with the release in smp_start() */
+		if (__atomic_load_n(&core->cpu_regs.reset, __ATOMIC_ACQUIRE)) {
+			nanosleep(&cpu_clk_freq, NULL);
+			continue;
+		}
+
+		cpu_run(core, 1);
+
+		smp_display_dirty(core);
+
+		if (core->cpu_regs.panic) {
+			smp_park(core);
+			continue;
+		}
+
+		if (core->cpu_regs.waiting) {
+			cpu_wait(core);
+			continue;
+		}
+
+		nanosleep(&cpu_clk_freq, NULL);
+	}
+
+	pthread_exit(NULL);
+}
+
+/*
+ * Called once core 0 is set up, RAM holds the boot image by then. The
+ * other cores get their registers in it and start out held.
+ */
+void smp_run(struct _machine *machine)
+{
+	struct _smp *smp = machine->smp;
+
+	if (!smp)
+		return;
+
+	for (int c = 1; c < smp->cores; c++) {
+		struct _machine *core = smp->core[c];
+
+		cpu_init(core);
+
+		ram_attach(core, machine->RAM);
+		core->dma = smp->dma + c;
+
+		intc_init(core);
+
+		cpu_reset(core);
+
+		vdc_reset(core);
+
+		intc_reset(core);
+
+		/* no vdc thread, display instructions are refused on this core */
+		core->vdc_regs.sync = 1;
+		core->vdc_regs.display.headless = 1;
+
+		smp->state[c] = SMP_HELD;
+
+		if (pthread_create(smp->thread + c, NULL, smp_core, core))
+			break;
+		smp->threads = c + 1;
+	}
+}
+
+/*
+ * cstart: start a held core at addr. Returns 1 if it was started, a
+ * running core gets IRQ_CORE instead.
+ */
+int smp_start(struct _machine *machine, unsigned int c, uint16_t addr)
+{
+	struct _smp *smp = machine->smp;
+	struct _machine *core;
+	int held = SMP_HELD;
+
+	if (!smp || (c >= smp->cores))
+		return 0;
+
+	core = smp->core[c];
+
+	if (!__atomic_compare_exchange_n(smp->state + c, &held, SMP_STARTING, 0,
+	    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		intc_raise(core, IRQ_CORE);
+		return 0;
+	}
+
+	core->cpu_regs.pc = addr - sizeof(uint32_t);	/* compensate for pc++ */
+	core->cpu_regs.mclk = machine->cpu_regs.mclk;
+	core->vdc_regs.display.mode = machine->vdc_regs.display.mode;
+
+	__atomic_store_n(smp->state + c, SMP_RUNNING, __ATOMIC_RELAXED);
+
+	/* everything stored so far is seen by the core once it runs */
+	__atomic_store_n(&core->cpu_regs.reset, 0, __ATOMIC_RELEASE);
+
+	cpu_kick(core);
+
+	return 1;
+}
+
+/* core 0 halted, end the others wherever they are */
+void smp_stop(struct _machine *machine)
+{
+	struct _smp *smp = machine->smp;
+
+	if (!smp)
+		return;
+
+	__atomic_store_n(&smp->stop, 1, __ATOMIC_RELEASE);
+
+	for (int c = 1; c < smp->threads; c++)
+		cpu_kick(smp->core[c]);
+
+	for (int c = 1; c < smp->threads; c++)
+		pthread_join(smp->thread[c], NULL);
+}
+
+void smp_destroy(struct _machine *machine)
+{
+	struct _smp *smp = machine->smp;
+
+	if (!smp)
+		return;
+
+	for (int c = 1; c < smp->cores; c++)
+		free(smp->core[c]);
+
+	free(smp);
+
+	machine->smp = NULL;
+}
@@ -0,0 +1,65 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __SMP_H_
+#define __SMP_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "dma.h"
+
+#define SMP_CORES_MAX		4	/* controllers that fit in the intc page */
+
+/* state of a core other than the first */
+#define SMP_HELD		0	/* waits for cstart */
+#define SMP_STARTING		1	/* claimed by a cstart */
+#define SMP_RUNNING		2
+
+/*
+ * Cores of one machine. All of them share RAM and run on threads of
+ * their own. Core 0 is the machine itself and owns the devices, every
+ * other core has only an interrupt controller and a timer.
+ */
+struct _smp {
+	int cores;
+	int stop;				/* the core threads end */
+	int threads;				/* cores below this have a thread */
+	int state[SMP_CORES_MAX];		/* SMP_*, core 0 always runs */
+	struct _machine *core[SMP_CORES_MAX];
+	pthread_t thread[SMP_CORES_MAX];
+	struct _dma_regs dma[SMP_CORES_MAX];	/* never busy, dma is core 0's */
+};
+
+struct _machine;
+
+int smp_create(struct _machine *machine, int cores);
+
+void smp_run(struct _machine *machine);
+
+int smp_start(struct _machine *machine, unsigned int core, uint16_t addr);
+
+void smp_stop(struct _machine *machine);
+
+void smp_destroy(struct _machine *machine);
+
+#endif /* __SMP_H_ */
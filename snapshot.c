@@ -0,0 +1,559 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Machine snapshots: a header with the cpu and vdc registers followed by
+ * the RAM image at a page aligned offset. Restore maps the image privately
+ * instead of reading it, so only pages the machine touches are ever loaded.
+ *
+ * Later snapshots of the same machine only append the pages written since
+ * the previous one to a journal, <snapshot>.delta. Once the journal grows
+ * past SNAPSHOT_DELTA_MAX a new base image is written and it starts over.
+ *
+ * The same file format backs persistent RAM, where the image is mapped
+ * shared and a snapshot only flushes it and updates the registers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "snapshot.h"
+#include "machine.h"
+#include "exception.h"
+#include "ram.h"
+
+#define SNAPSHOT_DEBUG(x)	x
+
+static int snapshot_write(int fd, const void *buf, size_t len)
+{
+	const uint8_t *ptr = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, ptr, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+void snapshot_get_regs(struct _machine *machine, struct _snapshot_cpu *scpu,
+	struct _snapshot_vdc *svdc)
+{
+	struct _cpu_regs *cpu = &machine->cpu_regs;
+	struct _vdc_regs *vdc = &machine->vdc_regs;
+
+	memcpy(scpu->GP_REG, cpu->GP_REG, sizeof(scpu->GP_REG));
+	scpu->pc = cpu->pc;
+	scpu->sp = cpu->sp;
+	scpu->cr = cpu->cr;
+	scpu->exception = cpu->exception;
+	scpu->mclk = cpu->mclk;
+	scpu->icount = cpu->icount;
+	scpu->br = cpu->br;
+	scpu->epc = cpu->epc;
+	scpu->ecr = cpu->ecr;
+	scpu->ebr = cpu->ebr;
+	scpu->ie = cpu->ie;
+	/* a polling loop is not saved, the restored cpu finds it again */
+	scpu->waiting = (cpu->waiting == CPU_WAIT_WFI);
+	scpu->retired = cpu->retired;
+
+	pthread_mutex_lock(&vdc->instr_lock);
+	memcpy(svdc->instr_list, vdc->instr_list, sizeof(svdc->instr_list));
+	svdc->instr_ptr = vdc->instr_ptr;
+	svdc->curr_instr = vdc->curr_instr;
+	pthread_mutex_unlock(&vdc->instr_lock);
+
+	svdc->exception = vdc->exception;
+	svdc->mode = vdc->display.mode;
+	svdc->enabled = vdc->display.enabled;
+	svdc->cursor_x = vdc->display.cursor_data.x;
+	svdc->cursor_y = vdc->display.cursor_data.y;
+	svdc->cursor_face = vdc->display.cursor_data.face;
+}
+
+/* registers from a file index tables and divide, check them before use */
+static int snapshot_regs_valid(const struct _snapshot_cpu *scpu,
+	const struct _snapshot_vdc *svdc)
+{
+	return (svdc->instr_ptr <= INSTR_LIST_SIZE) && (svdc->mode <= mode_640x480) &&
+		scpu->mclk;
+}
+
+void snapshot_set_regs(struct _machine *machine, struct _snapshot_cpu *scpu,
+	struct _snapshot_vdc *svdc)
+{
+	struct _cpu_regs *cpu = &machine->cpu_regs;
+	struct _vdc_regs *vdc = &machine->vdc_regs;
+
+	memcpy(cpu->GP_REG, scpu->GP_REG, sizeof(cpu->GP_REG));
+	cpu->pc = scpu->pc;
+	cpu->sp = scpu->sp;
+	cpu->cr = scpu->cr;
+	cpu->exception = scpu->exception;
+	cpu->mclk = scpu->mclk;
+	cpu->icount = scpu->icount;
+	cpu->br = scpu->br;
+	cpu->epc = scpu->epc;
+	cpu->ecr = scpu->ecr;
+	cpu->ebr = scpu->ebr;
+	cpu->ie = scpu->ie;
+	cpu->waiting = scpu->waiting ? CPU_WAIT_WFI : 0;
+	cpu->retired = scpu->retired;
+	cpu->idle = 0;
+	cpu->spin.pc = 0;
+
+	memcpy(vdc->instr_list, svdc->instr_list, sizeof(vdc->instr_list));
+	vdc->instr_ptr = svdc->instr_ptr;
+	vdc->curr_instr = svdc->curr_instr;
+	vdc->exception = svdc->exception;
+	vdc->display.mode = svdc->mode;
+	vdc->display.enabled = svdc->enabled;
+	vdc->display.cursor_data.x = svdc->cursor_x;
+	vdc->display.cursor_data.y = svdc->cursor_y;
+	vdc->display.cursor_data.face = svdc->cursor_face;
+}
+
+static __inline__ void snapshot_delta_name(char *name, const char *filename)
+{
+	snprintf(name, PATH_MAX, "%s.delta", filename);
+}
+
+/*
+ * Write the machine to filename. Must be called between two instructions
+ * on the cpu thread. The file is written next to the target and renamed,
+ * a reader never sees half a snapshot. An old journal no longer applies.
+ */
+int snapshot_save(struct _machine *machine, const char *filename)
+{
+	struct _snapshot_header hdr;
+	uint8_t pad[SNAPSHOT_RAM_OFFSET - sizeof(hdr)];
+	uint64_t dirty[RAM_PAGES / 64];
+	char tmp[PATH_MAX];
+	int fd;
+
+	memset(&hdr, 0x00, sizeof(hdr));
+	memset(pad, 0x00, sizeof(pad));
+
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.ram_offset = SNAPSHOT_RAM_OFFSET;
+	hdr.ram_size = RAM_SIZE;
+
+	snapshot_get_regs(machine, &hdr.cpu, &hdr.vdc);
+
+	/* everything written from here on goes into the next delta */
+	ram_dirty_collect(machine, RAM_DIRTY_SNAPSHOT, dirty);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto snapshot_save_fail;
+
+	if (snapshot_write(fd, &hdr, sizeof(hdr)) ||
+	    snapshot_write(fd, pad, sizeof(pad)) ||
+	    snapshot_write(fd, machine->RAM, RAM_SIZE)) {
+		close(fd);
+		unlink(tmp);
+		goto snapshot_save_fail;
+	}
+
+	close(fd);
+
+	if (rename(tmp, filename) < 0) {
+		unlink(tmp);
+		goto snapshot_save_fail;
+	}
+
+	snapshot_delta_name(tmp, filename);
+	unlink(tmp);
+
+	if (machine->snapshot) {
+		machine->snapshot->base = 1;
+		machine->snapshot->base_icount = hdr.cpu.icount;
+		machine->snapshot->delta_size = 0;
+	}
+
+	SNAPSHOT_DEBUG(printf("\n%s: %s at instruction %llu\n", __func__, filename,
+		(unsigned long long)machine->cpu_regs.icount));
+
+	return 0;
+
+snapshot_save_fail:
+	perror("snapshot failed");
+	return -1;
+}
+
+/* append the pages written since the last snapshot to the journal */
+static int snapshot_save_delta(struct _machine *machine)
+{
+	struct _snapshot_ctl *ctl = machine->snapshot;
+	struct _snapshot_delta *delta;
+	uint64_t dirty[RAM_PAGES / 64];
+	char name[PATH_MAX];
+	unsigned int pages;
+	uint8_t *rec;
+	size_t size;
+	int fd, ret;
+
+	pages = ram_dirty_collect(machine, RAM_DIRTY_SNAPSHOT, dirty);
+
+	size = sizeof(struct _snapshot_delta) + pages * (sizeof(uint32_t) + RAM_PAGE_SIZE);
+
+	delta = calloc(1, size);
+	if (!delta)
+		return -1;
+
+	delta->magic = SNAPSHOT_DELTA_MAGIC;
+	delta->pages = pages;
+	delta->base = ctl->base_icount;
+	snapshot_get_regs(machine, &delta->cpu, &delta->vdc);
+
+	rec = (uint8_t *)(delta + 1);
+	for (uint32_t p = 0; p < RAM_PAGES; p++) {
+		if (!(dirty[p / 64] & (1ULL << (p % 64))))
+			continue;
+
+		memcpy(rec, &p, sizeof(uint32_t));
+		memcpy(rec + sizeof(uint32_t), machine->RAM + (p << RAM_PAGE_SHIFT), RAM_PAGE_SIZE);
+		rec += sizeof(uint32_t) + RAM_PAGE_SIZE;
+	}
+
+	snapshot_delta_name(name, ctl->filename);
+
+	ret = -1;
+	fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd >= 0) {
+		ret = snapshot_write(fd, delta, size);
+		close(fd);
+	}
+
+	if (ret)
+		perror("snapshot failed");
+	else
+		ctl->delta_size += size;
+
+	SNAPSHOT_DEBUG(printf("\n%s: %u pages at instruction %llu\n", __func__, pages,
+		(unsigned long long)machine->cpu_regs.icount));
+
+	free(delta);
+
+	return ret;
+}
+
+/*
+ * Load the journal of a snapshot and check it belongs to the image. A
+ * record cut short by a crash ends the journal.
+ */
+static void snapshot_open_delta(struct _snapshot *snap, const char *filename)
+{
+	struct _snapshot_delta delta;
+	char name[PATH_MAX];
+	struct stat st;
+	size_t pos = 0;
+	int fd;
+
+	snapshot_delta_name(name, filename);
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) || !st.st_size)
+		goto snapshot_open_delta_close;
+
+	snap->delta = malloc(st.st_size);
+	if (!snap->delta || (read(fd, snap->delta, st.st_size) != st.st_size))
+		goto snapshot_open_delta_close;
+
+	while ((pos + sizeof(delta)) <= st.st_size) {
+		size_t size;
+
+		memcpy(&delta, snap->delta + pos, sizeof(delta));
+		size = sizeof(delta) + delta.pages * (sizeof(uint32_t) + RAM_PAGE_SIZE);
+
+		if ((delta.magic != SNAPSHOT_DELTA_MAGIC) ||
+		    (delta.base != snap->hdr.cpu.icount) ||
+		    (delta.pages > RAM_PAGES) || ((pos + size) > st.st_size) ||
+		    !snapshot_regs_valid(&delta.cpu, &delta.vdc))
+			break;
+
+		pos += size;
+	}
+
+	snap->delta_size = pos;
+
+snapshot_open_delta_close:
+	close(fd);
+}
+
+/*
+ * Open a snapshot to start machines from. The descriptor stays open,
+ * every machine forked from it maps the same RAM image.
+ */
+struct _snapshot *snapshot_open(const char *filename)
+{
+	struct _snapshot *snap;
+
+	snap = calloc(1, sizeof(struct _snapshot));
+	if (!snap)
+		return NULL;
+
+	snap->fd = open(filename, O_RDONLY);
+	if (snap->fd < 0) {
+		perror("cannot restore snapshot");
+		free(snap);
+		return NULL;
+	}
+
+	if ((read(snap->fd, &snap->hdr, sizeof(snap->hdr)) != sizeof(snap->hdr)) ||
+	    (snap->hdr.magic != SNAPSHOT_MAGIC) ||
+	    (snap->hdr.version != SNAPSHOT_VERSION) ||
+	    (snap->hdr.ram_size != RAM_SIZE) ||
+	    (snap->hdr.ram_offset % SNAPSHOT_RAM_OFFSET) ||
+	    !snapshot_regs_valid(&snap->hdr.cpu, &snap->hdr.vdc)) {
+		printf("cannot restore %s: Not a valid snapshot.\n", filename);
+		snapshot_close(snap);
+		return NULL;
+	}
+
+	snapshot_open_delta(snap, filename);
+
+	return snap;
+}
+
+/*
+ * Replace the state of a machine that went through reset with the
+ * snapshot. RAM is a private mapping of the image: all machines forked
+ * from one snapshot share its pages in the page cache and a machine
+ * gets its own copy of a page the first time it writes to it. Pages
+ * from the journal are copied in on top. The cpu stays in reset.
+ */
+int snapshot_fork(struct _machine *machine, struct _snapshot *snap)
+{
+	struct _snapshot_cpu *cpu = &snap->hdr.cpu;
+	struct _snapshot_vdc *vdc = &snap->hdr.vdc;
+	struct _snapshot_delta *delta;
+	size_t pos = 0;
+	uint8_t *ram;
+
+	ram = ram_map_file(snap->fd, snap->hdr.ram_offset, 0);
+	if (!ram) {
+		perror("cannot map snapshot");
+		return -1;
+	}
+
+	while (pos < snap->delta_size) {
+		uint8_t *rec;
+
+		delta = (struct _snapshot_delta *)(snap->delta + pos);
+		rec = (uint8_t *)(delta + 1);
+
+		for (uint32_t p = 0; p < delta->pages; p++) {
+			uint32_t page;
+
+			memcpy(&page, rec, sizeof(uint32_t));
+			if (page < RAM_PAGES)
+				memcpy(ram + (page << RAM_PAGE_SHIFT), rec + sizeof(uint32_t), RAM_PAGE_SIZE);
+			rec += sizeof(uint32_t) + RAM_PAGE_SIZE;
+		}
+
+		cpu = &delta->cpu;
+		vdc = &delta->vdc;
+		pos = rec - snap->delta;
+	}
+
+	ram_free(machine->RAM);
+	ram_attach(machine, ram);
+
+	snapshot_set_regs(machine, cpu, vdc);
+	vdc_restore(machine);
+
+	return 0;
+}
+
+void snapshot_close(struct _snapshot *snap)
+{
+	if (!snap)
+		return;
+
+	close(snap->fd);
+	free(snap->delta);
+	free(snap);
+}
+
+/* called by the cpu on every instruction boundary while snapshots are enabled */
+void snapshot_poll(struct _machine *machine)
+{
+	struct _snapshot_ctl *ctl = machine->snapshot;
+	uint64_t icount = machine->cpu_regs.icount;
+
+	if (!ctl->req && (!ctl->at || (icount != ctl->at)) &&
+	    (!ctl->every || (icount < ctl->next)))
+		return;
+
+	ctl->req = 0;
+	if (ctl->every)
+		ctl->next = icount + ctl->every;
+
+	if (ctl->persist)
+		snapshot_persist_sync(machine, SNAPSHOT_RUNNING);
+	else if (!ctl->base || (ctl->delta_size > SNAPSHOT_DELTA_MAX))
+		snapshot_save(machine, ctl->filename);
+	else
+		snapshot_save_delta(machine);
+}
+
+/*
+ * Map the RAM of the machine from ctl->filename. Returns 1 when the file
+ * held a machine, which is then resumed with the registers of its last
+ * sync point, 0 when the file is new and the machine has to boot.
+ */
+int snapshot_persist_open(struct _machine *machine, struct _snapshot_ctl *ctl)
+{
+	struct _snapshot_header hdr;
+	struct stat st;
+	int resume;
+	uint8_t *ram;
+
+	ctl->fd = open(ctl->filename, O_RDWR | O_CREAT, 0644);
+	if (ctl->fd < 0) {
+		perror("cannot open RAM file");
+		return -1;
+	}
+
+	resume = (fstat(ctl->fd, &st) == 0) &&
+		(st.st_size >= (SNAPSHOT_RAM_OFFSET + RAM_SIZE)) &&
+		(read(ctl->fd, &hdr, sizeof(hdr)) == sizeof(hdr)) &&
+		(hdr.magic == SNAPSHOT_MAGIC) && (hdr.version == SNAPSHOT_VERSION) &&
+		(hdr.ram_size == RAM_SIZE) && (hdr.ram_offset == SNAPSHOT_RAM_OFFSET);
+
+	/* bad registers in a RAM file of ours, do not boot over its RAM */
+	if (resume && !(hdr.flags & SNAPSHOT_HALTED) && !snapshot_regs_valid(&hdr.cpu, &hdr.vdc)) {
+		printf("cannot resume %s: Not a valid snapshot.\n", ctl->filename);
+		goto snapshot_persist_fail;
+	}
+
+	if (!resume) {
+		/* a sparse file reads as zero, nothing needs to be cleared */
+		if (ftruncate(ctl->fd, 0) || ftruncate(ctl->fd, SNAPSHOT_RAM_OFFSET + RAM_SIZE)) {
+			perror("cannot create RAM file");
+			goto snapshot_persist_fail;
+		}
+	}
+
+	ram = ram_map_file(ctl->fd, SNAPSHOT_RAM_OFFSET, 1);
+	if (!ram) {
+		perror("cannot map RAM file");
+		goto snapshot_persist_fail;
+	}
+
+	ram_free(machine->RAM);
+	ram_attach(machine, ram);
+
+	ctl->persist = 1;
+	machine->snapshot = ctl;
+
+	if (resume && (hdr.flags & SNAPSHOT_HALTED))
+		resume = 0;
+
+	if (resume) {
+		if (hdr.flags & SNAPSHOT_RUNNING)
+			printf("%s: %s was not shut down, resuming from the last sync\n",
+				__func__, ctl->filename);
+
+		snapshot_set_regs(machine, &hdr.cpu, &hdr.vdc);
+		vdc_restore(machine);
+	}
+
+	return resume;
+
+snapshot_persist_fail:
+	close(ctl->fd);
+	ctl->fd = -1;
+	return -1;
+}
+
+/*
+ * A sync point: RAM is flushed to the file first, then the registers
+ * that go with it.
+ */
+int snapshot_persist_sync(struct _machine *machine, uint32_t flags)
+{
+	struct _snapshot_ctl *ctl = machine->snapshot;
+	struct _snapshot_header hdr;
+
+	memset(&hdr, 0x00, sizeof(hdr));
+
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.ram_offset = SNAPSHOT_RAM_OFFSET;
+	hdr.ram_size = RAM_SIZE;
+	hdr.flags = flags;
+
+	snapshot_get_regs(machine, &hdr.cpu, &hdr.vdc);
+
+	/* a shutdown is not part of the machine, it resumes without it */
+	hdr.cpu.exception &= ~EXC_SHUTDOWN;
+
+	if (msync(machine->RAM, RAM_SIZE, MS_SYNC) ||
+	    (pwrite(ctl->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) ||
+	    fdatasync(ctl->fd)) {
+		perror("cannot sync RAM file");
+		return -1;
+	}
+
+	return 0;
+}
+
+void snapshot_persist_close(struct _machine *machine)
+{
+	struct _snapshot_ctl *ctl = machine->snapshot;
+	uint32_t flags = 0;
+
+	if (!ctl || !ctl->persist)
+		return;
+
+	/* a machine that stopped by itself boots again */
+	if (machine->cpu_regs.panic && !(machine->cpu_regs.exception & EXC_SHUTDOWN))
+		flags = SNAPSHOT_HALTED;
+
+	snapshot_persist_sync(machine, flags);
+
+	ram_free(machine->RAM);
+	machine->RAM = NULL;
+
+	close(ctl->fd);
+	ctl->persist = 0;
+}
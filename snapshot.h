@@ -0,0 +1,143 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SNAPSHOT_H_
+#define __SNAPSHOT_H_
+
+#include <stdint.h>
+
+#include "vdc.h"
+#include "registers.h"
+#include "memory.h"
+
+#define SNAPSHOT_MAGIC		0xe113a5a0
+#define SNAPSHOT_VERSION	6
+#define SNAPSHOT_RAM_OFFSET	4096	/* page aligned, so the image can be mapped */
+#define SNAPSHOT_DELTA_MAGIC	0xe113a5d0
+#define SNAPSHOT_DELTA_MAX	(RAM_SIZE / 2)	/* journal size that forces a new base */
+
+struct _machine;
+
+/*
+ * On disk machine state. Only fixed width fields, the layout does not
+ * follow the in memory registers. I/O registers live in RAM and are part
+ * of the image.
+ */
+struct _snapshot_cpu {
+	uint16_t GP_REG[GP_REG_MAX + 1];
+	uint32_t pc;
+	int32_t sp;
+	int32_t cr;
+	uint32_t exception;
+	uint32_t mclk;
+	uint64_t icount;
+	uint32_t br;
+	uint32_t epc;
+	int32_t ecr;
+	uint32_t ebr;
+	uint32_t ie;
+	uint32_t waiting;
+	uint64_t retired;
+};
+
+struct _snapshot_vdc {
+	uint32_t instr_list[INSTR_LIST_SIZE];
+	uint32_t curr_instr;
+	uint32_t exception;
+	uint8_t instr_ptr;
+	uint8_t mode;
+	uint8_t enabled;
+	uint8_t cursor_face;
+	uint16_t cursor_x;
+	uint16_t cursor_y;
+};
+
+enum snapshot_flags {
+	SNAPSHOT_RUNNING = 1,	/* persistent RAM in use, registers may be behind */
+	SNAPSHOT_HALTED = 2,	/* nothing to resume */
+};
+
+struct _snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ram_offset;
+	uint32_t ram_size;
+	uint32_t flags;
+	struct _snapshot_cpu cpu;
+	struct _snapshot_vdc vdc;
+};
+
+/*
+ * Record of the delta journal next to a snapshot, followed by the given
+ * number of pages as a uint32_t page index and RAM_PAGE_SIZE bytes.
+ */
+struct _snapshot_delta {
+	uint32_t magic;
+	uint32_t pages;
+	uint64_t base;		/* instruction count of the base image */
+	struct _snapshot_cpu cpu;
+	struct _snapshot_vdc vdc;
+};
+
+struct _snapshot {
+	int fd;
+	struct _snapshot_header hdr;
+	uint8_t *delta;		/* journal records on top of the image */
+	size_t delta_size;
+};
+
+/* when and where a running machine takes snapshots */
+struct _snapshot_ctl {
+	const char *filename;
+	uint64_t at;		/* snapshot after this many instructions */
+	uint64_t every;		/* and then periodically */
+	uint64_t next;
+	volatile int req;	/* snapshot at the next instruction boundary */
+	int base;		/* a base image was written */
+	uint64_t base_icount;
+	size_t delta_size;
+	int persist;		/* RAM lives in filename, snapshots only sync it */
+	int fd;
+};
+
+void snapshot_get_regs(struct _machine *machine, struct _snapshot_cpu *scpu,
+	struct _snapshot_vdc *svdc);
+
+void snapshot_set_regs(struct _machine *machine, struct _snapshot_cpu *scpu,
+	struct _snapshot_vdc *svdc);
+
+int snapshot_save(struct _machine *machine, const char *filename);
+
+struct _snapshot *snapshot_open(const char *filename);
+
+int snapshot_fork(struct _machine *machine, struct _snapshot *snap);
+
+void snapshot_close(struct _snapshot *snap);
+
+void snapshot_poll(struct _machine *machine);
+
+int snapshot_persist_open(struct _machine *machine, struct _snapshot_ctl *ctl);
+
+int snapshot_persist_sync(struct _machine *machine, uint32_t flags);
+
+void snapshot_persist_close(struct _machine *machine);
+
+#endif /* __SNAPSHOT_H_ */
@@ -27,6 +27,7 @@
 #include "registers.h"
 #include "prg.h"
 #include "memory.h"
+#include "exception.h"
 
 #undef NDEBUG
 #include <assert.h>
@@ -46,7 +47,7 @@
   R9
 */
 
-void test_result(uint16_t *GP_REG, uint8_t *RAM) {
+void test_result(uint16_t *GP_REG, uint8_t *RAM, unsigned int exception) {
 	assert(*(GP_REG + 2) == 42);
 	assert(*(GP_REG + 1) == 0xe4);
 	assert(*(GP_REG + 6) == *(GP_REG + 1));
@@ -63,6 +64,11 @@ void test_result(uint16_t *GP_REG, uint8_t *RAM) {
 	assert(*(uint16_t *)(RAM + MEM_IO_OUTPUT) == IO_OUT_TST_VAL);
 	assert(*(uint16_t *)(RAM + MEM_IO_INPUT) == IO_IN_TST_VAL);
 	assert(*(GP_REG + 9) == 0x40);  /* movmr */
+	assert(*(GP_REG + 12) == 0x0001);  /* mul */
+	assert(*(GP_REG + 13) == 0xf800);  /* sar */
+	assert(*(GP_REG + 15) == 0x0800);  /* shr */
+	assert(*(GP_REG + 14) == 7);  /* divu by zero */
+	assert(exception == EXC_DIV);
 }
 
 const uint32_t program_regression_test[] = {
@@ -75,15 +81,15 @@ const uint32_t program_regression_test[] = {
 	(mov << 0) | (R1 << 8)  | OP_DST_REG | (0x0A << 16), 			/* posx = 10 */
 	(mov << 0) | (R2 << 8)  | OP_DST_REG | (0x01 << 16), 			/* posy = 1 */
 
-	(disetxy << 0) | R1  << 16 | (R2 << 24),
+	(disetxy << 0) | R1  << 8 | (R2 << 20),
 	(dichar << 0) | ('T' << 16),
 
 	(add << 0) | (R1 << 8)  | OP_DST_REG | (0x01 << 16),
-	(disetxy << 0) | R1  << 16 | (R2 << 24),
+	(disetxy << 0) | R1  << 8 | (R2 << 20),
 	(dichar << 0) | ('S' << 16),
 
 	(add << 0) | (R1 << 8)  | OP_DST_REG | (0x01 << 16),
-	(disetxy << 0) | R1  << 16 | (R2 << 24),
+	(disetxy << 0) | R1  << 8 | (R2 << 20),
 	(dichar << 0) | ('T' << 16),
 	(nop << 0),
 
@@ -142,8 +148,15 @@ const uint32_t program_regression_test[] = {
 	(mov << 0) | (R9 << 8)  | OP_DST_REG | (0x514 << 16),
 	(movmr << 0) | (R9 << 8)  |  (R9 << 12),				/* r9 = RAM[ r9 ] == 0x40 */
 
-
-	(halt << 0),
+	/* test mul, shifts and divide by zero */
+	(mov << 0) | (R12 << 8)  | OP_DST_REG | (0xFFFFu << 16),		/* r12 = 0xffff */
+	(mul << 0) | (R12 << 8)  | OP_DST_REG | OP_SRC_REG | (R12 << 16),	/* r12 = 0xffff * 0xffff, low word 1 */
+	(mov << 0) | (R13 << 8)  | OP_DST_REG | (0x8000 << 16),		/* r13 = 0x8000 */
+	(sar << 0) | (R13 << 8)  | OP_DST_REG | (0x04 << 16),			/* r13 = 0xf800, sign kept */
+	(mov << 0) | (R15 << 8)  | OP_DST_REG | (0x8000 << 16),		/* r15 = 0x8000 */
+	(shr << 0) | (R15 << 8)  | OP_DST_REG | (0x04 << 16),			/* r15 = 0x0800 */
+	(mov << 0) | (R14 << 8)  | OP_DST_REG | (0x07 << 16),			/* r14 = 7 */
+	(divu << 0) | (R14 << 8)  | OP_DST_REG | (0x00 << 16),		/* EXC_DIV stops the machine, r14 is kept */
 };
 
 #endif /* TESTPROGRAM_H_ */
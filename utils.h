@@ -19,12 +19,18 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef __UTILS_H_
+#define __UTILS_H_
+
 #include <stdio.h>
 #include <stdint.h>
 
 #include "opcodes.h"
 
 #define DBG_HISTORY 8 /* fixme: program argument instead */
+
+#define CACHE_LINE_SIZE		64
+#define __cacheline_aligned	__attribute__((aligned(CACHE_LINE_SIZE)))
 #define DUMP_RAM_SIZE_DEFAULT 32
 
 struct _dbg {
@@ -53,3 +59,4 @@ void dump_io(uint16_t in, uint16_t out);
 
 char *int_to_str(int num);
 
+#endif /* __UTILS_H_ */
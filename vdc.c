@@ -30,6 +30,8 @@
 #include "memory.h"
 #include "machine.h"
 #include "utils.h"
+#include "replay.h"
+#include "ram.h"
 
 #define VDC_DBG(x)
 
@@ -44,10 +46,6 @@ const struct _adapter_mode const adapter_mode[] = {
 	{mode_640x480, 640, 480, 640*480},
 };
 
-static exception_t (*display_set)(struct _machine *machine);
-static exception_t (*display_retrace)(struct _vdc_regs *vdc);
-static void (*display_clear)(struct _vdc_regs *vdc);
-
 static void display_wait_retrace(struct _vdc_regs *vdc)
 {
 	if (!vdc->display.enabled) {
@@ -68,15 +66,16 @@ static exception_t vdc_set_mode(struct _vdc_regs *vdc, display_mode mode)
 	switch(mode) {
 		case mode_80x25:
 		case mode_40x12:
-			display_retrace = display_retrace_mode_console;
-			display_clear = display_clear_mode_console;
-			display_set = display_put_char;
+			vdc->display_retrace = display_retrace_mode_console;
+			vdc->display_clear = display_clear_mode_console;
+			vdc->display_set = display_put_char;
 			break;
 		case mode_640x480:
-			display_init_vga(&vdc->display, &mode);
-			display_retrace = display_retrace_mode_vga;
-			display_clear = display_clear_mode_vga;
-			display_set = display_put_pixel;
+			if (!vdc->display.headless)
+				display_init_vga(&vdc->display, &mode);
+			vdc->display_retrace = display_retrace_mode_vga;
+			vdc->display_clear = display_clear_mode_vga;
+			vdc->display_set = display_put_pixel;
 
 			break;
 		case mode_unknown:
@@ -87,7 +86,7 @@ static exception_t vdc_set_mode(struct _vdc_regs *vdc, display_mode mode)
 	vdc->display.mode = mode;
 	vdc->display.refresh = 0;
 
-	display_clear(vdc);
+	vdc->display_clear(vdc);
 
 	vdc->display.enabled = 1;
 
@@ -107,17 +106,26 @@ static void vdc_decode_instr(struct _machine *machine)
 			break;
 		case dimd:
 			vdc->exception = vdc_set_mode(vdc, (vdc->curr_instr >> 8));
+			ram_mark_dirty(machine, MEM_START_VDC_FB,
+				adapter_mode[vdc->display.mode].resolution);
 			break;
  		case diclr:
- 			display_clear(vdc);
+ 			vdc->display_clear(vdc);
+			ram_mark_dirty(machine, MEM_START_VDC_FB,
+				adapter_mode[vdc->display.mode].resolution);
 			break;
 		case disetxy:
+			if ((((vdc->curr_instr >> 8) & 0xfff) > GP_REG_MAX) ||
+			    (((vdc->curr_instr >> 20) & 0xfff) > GP_REG_MAX)) {
+				vdc->exception = EXC_VDC;
+				break;
+			}
 			vdc->display.cursor_data.x = machine->cpu_regs.GP_REG[ (vdc->curr_instr >> 8) & 0xfff ];
 			vdc->display.cursor_data.y = machine->cpu_regs.GP_REG[ (vdc->curr_instr >> 20) & 0xfff ];
 			break;
 		case dichar:
 		case diputpixel:
-			vdc->exception = display_set(machine); //vdc_put_char(machine);
+			vdc->exception = vdc->display_set(machine); //vdc_put_char(machine);
 			break;
 		default:
 			printf("vdc error unknown. instr: 0x%x ip: %u\n", opcode, vdc->instr_ptr);
@@ -179,19 +187,134 @@ void vdc_reset(void *mach)
 	machine->vdc_regs.instr_ptr = 0;
 	machine->vdc_regs.exception = EXC_NONE;
 
+	machine->vdc_regs.sync = 0;
+	machine->vdc_regs.display.headless = 0;
+
 	/* default to text mode */
 	machine->vdc_regs.display.mode = mode_40x12;
-	display_retrace = display_retrace_mode_console;
-	display_clear = display_clear_mode_console;
+	machine->vdc_regs.display_retrace = display_retrace_mode_console;
+	machine->vdc_regs.display_clear = display_clear_mode_console;
+	machine->vdc_regs.display_set = display_put_char;
 
 	pthread_mutex_init(&machine->vdc_regs.instr_lock, NULL);
 }
 
+/*
+ * Pick the display functions for the mode in the registers. Same as a
+ * mode switch except that neither the cursor nor the screen contents
+ * are touched.
+ */
+void vdc_display_select(struct _vdc_regs *vdc)
+{
+	display_mode mode = vdc->display.mode;
+
+	switch(mode) {
+		case mode_640x480:
+			if (!vdc->display.headless && !vdc->display.screen)
+				display_init_vga(&vdc->display, &mode);
+			vdc->display_retrace = display_retrace_mode_vga;
+			vdc->display_clear = display_clear_mode_vga;
+			vdc->display_set = display_put_pixel;
+			break;
+		default:
+			vdc->display_retrace = display_retrace_mode_console;
+			vdc->display_clear = display_clear_mode_console;
+			vdc->display_set = display_put_char;
+			break;
+	}
+}
+
+/* reattach the display after the registers were loaded from a snapshot */
+void vdc_restore(void *mach)
+{
+	struct _machine *machine = mach;
+	struct _vdc_regs *vdc = &machine->vdc_regs;
+
+	vdc->display.screen = NULL;
+	vdc->display.screen_surface = NULL;
+	vdc->display.refresh = 0;
+
+	vdc_display_select(vdc);
+
+	pthread_mutex_init(&vdc->instr_lock, NULL);
+
+	/* a new window, draw it all */
+	ram_mark_dirty(machine, MEM_START_VDC_FB, adapter_mode[vdc->display.mode].resolution);
+}
+
+/* the screen only needs drawing when the frame buffer changed */
+static __inline__ int vdc_frame_damaged(struct _machine *machine)
+{
+	return ram_dirty_range(machine, RAM_DIRTY_DISPLAY, MEM_START_VDC_FB,
+		adapter_mode[machine->vdc_regs.display.mode].resolution);
+}
+
+static void vdc_step(struct _machine *machine)
+{
+	vdc_fetch_instr(&machine->vdc_regs);
+
+	vdc_decode_instr(machine);
+
+	/* headless machines see the retrace without the drawing */
+	if (machine->vdc_regs.display.enabled && vdc_frame_damaged(machine)) {
+		if (!machine->vdc_regs.display.headless)
+			machine->vdc_regs.display_retrace(&machine->vdc_regs);
+
+		intc_raise(machine, IRQ_VDC_RETRACE);
+	}
+
+	machine->cpu_regs.exception |= machine->vdc_regs.exception;
+}
+
+/*
+ * Drain the instruction list on the calling thread. Used when the vdc
+ * has no thread of its own and is driven by the cpu.
+ */
+void vdc_run(void *mach)
+{
+	struct _machine *machine = mach;
+
+	while (machine->vdc_regs.instr_ptr)
+		vdc_step(machine);
+}
+
+/*
+ * One vdc clock: execute the next instruction, redraw and check the
+ * window for a quit request.
+ */
+void vdc_tick(void *mach)
+{
+	struct _machine *machine = mach;
+	SDL_Event vdc_events;
+
+	/* with sync the cpu runs the instructions */
+	if (!machine->vdc_regs.sync)
+		vdc_step(machine);
+
+	if ((machine->vdc_regs.display.mode == mode_640x480) &&
+	    !machine->vdc_regs.display.headless) {
+		SDL_PollEvent(&vdc_events);
+
+		if (vdc_events.type == SDL_QUIT)
+			replay_post(machine, REPLAY_QUIT, NULL, 0);
+	}
+}
+
+void vdc_close(void *mach)
+{
+	struct _machine *machine = mach;
+
+	if ((machine->vdc_regs.display.mode == mode_640x480) &&
+	    !machine->vdc_regs.display.headless) {
+		SDL_DestroyWindow(machine->vdc_regs.display.screen);
+		SDL_Quit();
+	}
+}
+
 void *vdc_machine(void *mach)
 {
 	struct _machine *machine = mach;
 	struct timespec vdc_clk_freq;
-	SDL_Event vdc_events;
 
 	vdc_clk_freq.tv_sec = 0;
 
@@ -202,28 +325,12 @@ void *vdc_machine(void *mach)
 			nanosleep(&vdc_clk_freq, NULL);
 		}
 
-		vdc_fetch_instr(&machine->vdc_regs);
+		vdc_tick(machine);
 
-		vdc_decode_instr(machine);
-
-		if (machine->vdc_regs.display.enabled)
-			display_retrace(&machine->vdc_regs);
-		
-		machine->cpu_regs.exception |= machine->vdc_regs.exception;
-
-		if (machine->vdc_regs.display.mode == mode_640x480) {
-			SDL_PollEvent(&vdc_events);
-
-			if (vdc_events.type == SDL_QUIT)
- 				machine->cpu_regs.panic = 1;
-		}
 		nanosleep(&vdc_clk_freq, NULL);
 	}
 
-	if (machine->vdc_regs.display.mode == mode_640x480) {
-		SDL_DestroyWindow(machine->vdc_regs.display.screen);
-		SDL_Quit();
-	}
+	vdc_close(machine);
 
 	pthread_exit(NULL);
-}
\ No newline at end of file
+}
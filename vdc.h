@@ -27,6 +27,7 @@
 #include <pthread.h>
 
 #include "exception.h"
+#include "utils.h"
 
 /* fixme: make cross platform compatible */
 #define vdc_display_clear() printf("\033[H\033[J")
@@ -36,6 +37,8 @@
 
 #define INSTR_LIST_SIZE 32
 
+struct _machine;
+
 typedef enum {
 	mode_40x12,
 	mode_80x25,
@@ -56,11 +59,14 @@ struct _adapter_mode {
 	uint32_t resolution;
 };
 
+extern const struct _adapter_mode adapter_mode[];	/* by display_mode, see vdc.c */
+
 struct _display_adapter {
 	struct _cursor_data cursor_data;
 	int refresh;
 	display_mode mode;
 	int enabled;
+	int headless;		/* never draw, only keep the frame buffer */
 	SDL_Window *screen;
 	SDL_Surface *screen_surface;
 };
@@ -74,7 +80,11 @@ struct _vdc_regs {
 	pthread_mutex_t instr_lock;
 	exception_t exception;
 	uint8_t reset;
-	struct _display_adapter display;
+	uint8_t sync;		/* instructions run on the cpu thread */
+	struct _display_adapter display __cacheline_aligned;	/* vdc thread only */
+	exception_t (*display_set)(struct _machine *machine);
+	exception_t (*display_retrace)(struct _vdc_regs *vdc);
+	void (*display_clear)(struct _vdc_regs *vdc);
 };
 
 
@@ -82,6 +92,16 @@ exception_t vdc_add_instr(struct _vdc_regs *vdc, uint32_t *instr);
 
 void vdc_reset(void *mach);
 
+void vdc_restore(void *mach);
+
+void vdc_display_select(struct _vdc_regs *vdc);
+
+void vdc_run(void *mach);
+
+void vdc_tick(void *mach);
+
+void vdc_close(void *mach);
+
 void *vdc_machine(void *mach);
 
 #endif /* __VDC_H__ */
\ No newline at end of file
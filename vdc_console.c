@@ -1,4 +1,5 @@
 #include "vdc_console.h"
+#include "ram.h"
 
 extern const struct _adapter_mode const adapter_mode[];
 
@@ -73,6 +74,7 @@ exception_t display_put_char(struct _machine *machine)
 		return EXC_VDC;
 
 	*(vdc->frame_buffer + addr) = c;
+	ram_mark_dirty(machine, MEM_START_VDC_FB + addr, 1);
 
 	return EXC_NONE;
 }
@@ -1,4 +1,5 @@
 #include "vdc_vga.h"
+#include "ram.h"
 
 extern const struct _adapter_mode const adapter_mode[];
 
@@ -46,6 +47,19 @@ exception_t display_put_pixel(struct _machine *machine)
 	if (vdc->display.mode != mode_640x480)
 		return EXC_VDC;
 
+	if (vdc->display.headless) {
+		int addr = (vdc->display.cursor_data.y * adapter_mode[mode_640x480].vertical) +
+			vdc->display.cursor_data.x;
+
+		if ((addr + MEM_START_VDC_FB) >= RAM_SIZE)
+			return EXC_VDC;
+
+		*(vdc->frame_buffer + addr) = 0xff;
+		ram_mark_dirty(machine, MEM_START_VDC_FB + addr, 1);
+
+		return EXC_NONE;
+	}
+
 	uint32_t yellow = SDL_MapRGB(vdc->display.screen_surface->format, 0xff, 0xff, 0x00);
 
 	int x = vdc->display.cursor_data.x;
@@ -143,8 +157,9 @@ exception_t display_retrace_mode_vga(struct _vdc_regs *vdc)
 
 void display_clear_mode_vga(struct _vdc_regs *vdc)
 {
-	SDL_FillRect(vdc->display.screen_surface, NULL,
-		SDL_MapRGB(vdc->display.screen_surface->format, 0x00, 0x00, 0x00));
+	if (!vdc->display.headless)
+		SDL_FillRect(vdc->display.screen_surface, NULL,
+			SDL_MapRGB(vdc->display.screen_surface->format, 0x00, 0x00, 0x00));
 
 	memset(&vdc->frame_buffer[0], 0x00, adapter_mode[vdc->display.mode].resolution);
 }
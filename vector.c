@@ -0,0 +1,207 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Vector kernels for the vadd .. vsum instructions.
+ *
+ * The cpu checks the vectors and hands over plain RAM. On hosts with
+ * SSE2 (every x86-64) 16 bytes are done per step, the rest and other
+ * hosts go one lane at a time. Both give the same result, so a program
+ * recorded on one host replays on another.
+ */
+
+#include "vector.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define VEC_STEP	16	/* bytes per host vector */
+
+static __inline__ uint8_t vector_lane8(int op, uint8_t a, uint8_t b)
+{
+	switch (op) {
+	case VEC_ADD:
+		return a + b;
+	case VEC_SUB:
+		return a - b;
+	case VEC_MIN:
+		return (a < b) ? a : b;
+	case VEC_MAX:
+		return (a > b) ? a : b;
+	default:
+		return (a == b) ? 0xff : 0x00;
+	}
+}
+
+static __inline__ uint16_t vector_lane16(int op, uint16_t a, uint16_t b)
+{
+	switch (op) {
+	case VEC_ADD:
+		return a + b;
+	case VEC_SUB:
+		return a - b;
+	case VEC_MIN:
+		return (a < b) ? a : b;
+	case VEC_MAX:
+		return (a > b) ? a : b;
+	default:
+		return (a == b) ? 0xffff : 0x0000;
+	}
+}
+
+#ifdef __SSE2__
+/*
+ * A step reads all of its src lanes before it writes dst. That is only
+ * different from lane order when dst is less than a step above src.
+ */
+static __inline__ int vector_step_ok(const uint8_t *dst, const uint8_t *src)
+{
+	return (dst <= src) || (dst >= src + VEC_STEP);
+}
+
+static __inline__ __m128i vector_step8(int op, __m128i a, __m128i b)
+{
+	switch (op) {
+	case VEC_ADD:
+		return _mm_add_epi8(a, b);
+	case VEC_SUB:
+		return _mm_sub_epi8(a, b);
+	case VEC_MIN:
+		return _mm_min_epu8(a, b);
+	case VEC_MAX:
+		return _mm_max_epu8(a, b);
+	default:
+		return _mm_cmpeq_epi8(a, b);
+	}
+}
+
+static __inline__ __m128i vector_step16(int op, __m128i a, __m128i b)
+{
+	switch (op) {
+	case VEC_ADD:
+		return _mm_add_epi16(a, b);
+	case VEC_SUB:
+		return _mm_sub_epi16(a, b);
+	/* SSE2 has no unsigned 16 bit min and max, go by a - b clamped at 0 */
+	case VEC_MIN:
+		return _mm_sub_epi16(a, _mm_subs_epu16(a, b));
+	case VEC_MAX:
+		return _mm_add_epi16(b, _mm_subs_epu16(a, b));
+	default:
+		return _mm_cmpeq_epi16(a, b);
+	}
+}
+#endif
+
+void vector_op8(int op, uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+	uint32_t i = 0;
+
+#ifdef __SSE2__
+	if (vector_step_ok(dst, src)) {
+		for (; i + VEC_STEP <= n; i += VEC_STEP) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+			__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+
+			_mm_storeu_si128((__m128i *)(dst + i), vector_step8(op, a, b));
+		}
+	}
+#endif
+
+	for (; i < n; i++)
+		dst[i] = vector_lane8(op, dst[i], src[i]);
+}
+
+void vector_op16(int op, uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+	uint32_t i = 0;
+	uint16_t val;
+
+#ifdef __SSE2__
+	/* RAM is little endian like the host */
+	if (vector_step_ok(dst, src)) {
+		for (; i + VEC_STEP / 2 <= n; i += VEC_STEP / 2) {
+			__m128i a = _mm_loadu_si128((const __m128i *)(dst + 2 * i));
+			__m128i b = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+
+			_mm_storeu_si128((__m128i *)(dst + 2 * i), vector_step16(op, a, b));
+		}
+	}
+#endif
+
+	for (; i < n; i++) {
+		val = vector_lane16(op, dst[2 * i] | (dst[2 * i + 1] << 8),
+			src[2 * i] | (src[2 * i + 1] << 8));
+		dst[2 * i] = val & 0xff;
+		dst[2 * i + 1] = val >> 8;
+	}
+}
+
+uint32_t vector_sum8(const uint8_t *src, uint32_t n)
+{
+	uint32_t sum = 0;
+	uint32_t i = 0;
+
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128();
+
+	for (; i + VEC_STEP <= n; i += VEC_STEP) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, _mm_setzero_si128()));
+	}
+
+	sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+
+	for (; i < n; i++)
+		sum += src[i];
+
+	return sum;
+}
+
+uint32_t vector_sum16(const uint8_t *src, uint32_t n)
+{
+	uint32_t sum = 0;
+	uint32_t i = 0;
+
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128();
+
+	for (; i + VEC_STEP / 2 <= n; i += VEC_STEP / 2) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+
+		acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, _mm_setzero_si128()));
+		acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, _mm_setzero_si128()));
+	}
+
+	acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+	acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 4));
+	sum = _mm_cvtsi128_si32(acc);
+#endif
+
+	for (; i < n; i++)
+		sum += src[2 * i] | (src[2 * i + 1] << 8);
+
+	return sum;
+}
@@ -0,0 +1,48 @@
+/*
+ * Eira Virtual Machine
+ *
+ * Copyright (C) 2018
+ *
+ * Author: Björn Östby <bjorn.ostby@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __VECTOR_H_
+#define __VECTOR_H_
+
+#include <stdint.h>
+
+/* lane operations, in the order of their opcodes from vadd */
+#define VEC_ADD		0
+#define VEC_SUB		1
+#define VEC_MIN		2
+#define VEC_MAX		3
+#define VEC_CMP		4
+
+/*
+ * Lane-wise dst[i] = dst[i] op src[i] over n bytes or n little endian
+ * 16 bit words. Lanes are done in ascending order.
+ */
+void vector_op8(int op, uint8_t *dst, const uint8_t *src, uint32_t n);
+
+void vector_op16(int op, uint8_t *dst, const uint8_t *src, uint32_t n);
+
+/* sum of n bytes or words, n small enough not to overflow 32 bits */
+uint32_t vector_sum8(const uint8_t *src, uint32_t n);
+
+uint32_t vector_sum16(const uint8_t *src, uint32_t n);
+
+#endif /* __VECTOR_H_ */